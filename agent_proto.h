@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+#else
+    #include <arpa/inet.h>
+#endif
+
+// ssh-agent protocol, see draft-miller-ssh-agent
+#define SSH_AGENT_FAILURE                           5
+#define SSH_AGENT_SUCCESS                           6
+#define SSH2_AGENTC_REQUEST_IDENTITIES              11
+#define SSH2_AGENT_IDENTITIES_ANSWER                12
+#define SSH2_AGENTC_SIGN_REQUEST                    13
+#define SSH2_AGENT_SIGN_RESPONSE                    14
+#define SSH2_AGENTC_ADD_IDENTITY                    17
+#define SSH2_AGENTC_REMOVE_IDENTITY                 18
+#define SSH2_AGENTC_REMOVE_ALL_IDENTITIES           19
+#define SSH_AGENTC_ADD_SMARTCARD_KEY                20
+#define SSH_AGENTC_REMOVE_SMARTCARD_KEY             21
+#define SSH_AGENTC_LOCK                             22
+#define SSH_AGENTC_UNLOCK                           23
+#define SSH2_AGENTC_ADD_ID_CONSTRAINED              25
+#define SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED    26
+#define SSH_AGENTC_EXTENSION                        27
+
+#define SA_HEADER_LEN 4  // big endian length of the rest of message
+#define SA_MAX_MESSAGE_LEN (256 * 1024)  // with the header, as OpenSSH and PuTTY limit it
+
+
+// returns length of ssh-agent protocol message without the header
+inline uint32_t SaMessageLen(const void* p) {
+    uint32_t len;
+    std::memcpy(&len, p, sizeof(len));
+    return ntohl(len);
+}
+
+// returns type of a complete ssh-agent protocol message, zero for an empty one
+inline uint8_t SaMessageType(const void* p, size_t len) {
+    return len > SA_HEADER_LEN && SaMessageLen(p) > 0
+            ? static_cast<const uint8_t*>(p)[SA_HEADER_LEN]
+            : 0;
+}
+
+// whether the message changes the set of identities the agent offers
+inline bool SaChangesIdentities(uint8_t type) {
+    switch (type) {
+    case SSH2_AGENTC_ADD_IDENTITY:
+    case SSH2_AGENTC_REMOVE_IDENTITY:
+    case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+    case SSH_AGENTC_ADD_SMARTCARD_KEY:
+    case SSH_AGENTC_REMOVE_SMARTCARD_KEY:
+    case SSH_AGENTC_LOCK:
+    case SSH_AGENTC_UNLOCK:
+    case SSH2_AGENTC_ADD_ID_CONSTRAINED:
+    case SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED:
+        return true;
+    default:
+        return false;
+    }
+}
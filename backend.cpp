@@ -0,0 +1,873 @@
+#include "backend.h"
+#include "agent_proto.h"
+#include "metrics.h"
+#include "poller.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+    #include <Windows.h>
+    #include <afunix.h>
+    #define SEND_FLAGS 0
+#else
+    #include <sys/un.h>
+    #define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+namespace {
+
+void PutUint32(char* p, uint32_t value) {
+    value = htonl(value);
+    std::memcpy(p, &value, sizeof(value));
+}
+
+// reads a uint32 of the message at `pos` and advances it; false if it's out of bounds
+bool ReadUint32(const char* msg, size_t len, size_t& pos, uint32_t& value) {
+    if (len < pos || len - pos < 4)
+        return false;
+    value = SaMessageLen(msg + pos);
+    pos += 4;
+    return true;
+}
+
+// the same for an ssh string
+bool ReadString(const char* msg, size_t len, size_t& pos, const char*& data, uint32_t& size) {
+    if (!ReadUint32(msg, len, pos, size) || len - pos < size)
+        return false;
+    data = msg + pos;
+    pos += size;
+    return true;
+}
+
+const char FAILURE[] = { 0, 0, 0, 1, SSH_AGENT_FAILURE };
+
+// writes a message of the type with `bodyLen` bytes of payload left to the caller
+size_t PutMessage(char* p, uint8_t type, size_t bodyLen) {
+    PutUint32(p, uint32_t(1 + bodyLen));
+    p[SA_HEADER_LEN] = char(type);
+    return SA_HEADER_LEN + 1 + bodyLen;
+}
+
+bool IsNamedPipe(const std::string& path) {
+    return path.compare(0, 9, "\\\\.\\pipe\\") == 0;
+}
+
+// the agent has closed the connection meanwhile, e.g. after its restart
+bool IsClosedByPeer(int err) {
+#ifdef _WIN32
+    return err == WSAECONNRESET || err == WSAECONNABORTED;
+#else
+    return err == EPIPE || err == ECONNRESET;
+#endif
+}
+
+// a send or receive took longer than SO_SNDTIMEO/SO_RCVTIMEO
+bool IsSocketTimeout(int err) {
+#ifdef _WIN32
+    return err == WSAETIMEDOUT;
+#else
+    return IsWouldBlock(err);
+#endif
+}
+
+#ifdef _WIN32
+// Reads or writes the agent pipe opened for overlapped I/O, cancelling the operation
+// after the timeout as pipes have no timeouts of their own. Returns a Win32 error,
+// WAIT_TIMEOUT if it's been cancelled.
+DWORD TransferPipe(HANDLE pipe, HANDLE event, bool write, void* data, DWORD len, DWORD timeoutMs, DWORD& done) {
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = event;
+    done = 0;
+
+    const BOOL ok = write ? WriteFile(pipe, data, len, NULL, &overlapped) : ReadFile(pipe, data, len, NULL, &overlapped);
+    if (!ok) {
+        const DWORD err = GetLastError();
+        if (err != ERROR_IO_PENDING)
+            return err;
+    }
+
+    bool cancelled = false;
+    if (WaitForSingleObject(event, timeoutMs) != WAIT_OBJECT_0)
+        cancelled = CancelIoEx(pipe, &overlapped) != FALSE;
+    if (!GetOverlappedResult(pipe, &overlapped, &done, TRUE)) {
+        const DWORD err = GetLastError();
+        return cancelled && err == ERROR_OPERATION_ABORTED ? WAIT_TIMEOUT : err;
+    }
+    return ERROR_SUCCESS;
+}
+#endif
+
+std::string DefaultAgentPath() {
+#ifdef _WIN32
+    return OPENSSH_AGENT_PIPE;
+#else
+    const char* sock = std::getenv("SSH_AUTH_SOCK");
+    if (!sock || !*sock)
+        THROW_RUNTIME_ERROR("no upstream agent path given and SSH_AUTH_SOCK isn't set");
+    return sock;
+#endif
+}
+
+// the latency of a "stub:<latency us>" spec, none if it's left out
+unsigned StubLatency(const std::string& spec, const std::string& arg) {
+    if (arg.empty())
+        return 0;
+
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long long latency = std::strtoull(arg.c_str(), &end, 10);
+    if (*end || errno || arg[0] < '0' || arg[0] > '9' || latency > STUB_MAX_LATENCY_US)
+        THROW_RUNTIME_ERROR("invalid stub latency, expected microseconds up to " << STUB_MAX_LATENCY_US << ": " << spec);
+    return unsigned(latency);
+}
+
+}  // anonymous namespace
+
+
+std::unique_ptr<AgentBackend> AgentBackend::Create(const std::string& spec)
+{
+    if (spec.find(';') != std::string::npos) {
+        std::vector<std::unique_ptr<AgentBackend>> backends;
+        for (size_t pos = 0; pos <= spec.size(); ) {
+            const size_t end = std::min(spec.find(';', pos), spec.size());
+            if (end > pos)
+                backends.push_back(Create(spec.substr(pos, end - pos)));
+            pos = end + 1;
+        }
+        return std::unique_ptr<AgentBackend>(new MultiBackend(std::move(backends)));
+    }
+
+    const size_t colon = spec.find(':');
+    const std::string kind = spec.substr(0, colon);
+    const std::string arg = colon == std::string::npos ? std::string() : spec.substr(colon + 1);
+
+    std::unique_ptr<AgentBackend> backend;
+    if (kind.empty() || kind == "pageant") {
+#ifdef _WIN32
+        backend.reset(new PageantBackend());
+#else
+        THROW_RUNTIME_ERROR("Pageant backend is available on Windows only");
+#endif
+    } else if (kind == "agent") {
+        backend.reset(new UpstreamAgentBackend(arg.empty() ? DefaultAgentPath() : arg));
+    } else if (kind == "stub") {
+        backend.reset(new StubBackend(StubLatency(spec, arg)));
+    } else {
+        THROW_RUNTIME_ERROR("unknown agent backend: " << spec);
+    }
+
+    LOG_DEBUG("Agent backend: " << spec);
+    return backend;
+}
+
+
+DeferredBackend::DeferredBackend(const std::string& spec)
+    : Backend(std::async(std::launch::async, &AgentBackend::Create, spec))
+{ }
+
+
+//------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+void PageantBackend::Begin(Context& ctx)
+{
+    const FileMapping& channel = Agent.AcquireChannel();
+    ctx.Area = static_cast<char*>(channel.GetView());
+    ctx.Capacity = channel.GetSize();
+    ctx.Token = &channel;
+}
+
+Buffer PageantBackend::Query(Context& ctx, size_t len)
+{
+    return Agent.Transact(*static_cast<const FileMapping*>(ctx.Token), len);
+}
+
+void PageantBackend::End(Context& ctx) noexcept
+{
+    Agent.ReleaseChannel(*static_cast<const FileMapping*>(ctx.Token));
+}
+
+#endif
+
+
+//------------------------------------------------------------------------------
+
+// a connection to the upstream agent opened on first use and kept while it's used
+struct UpstreamAgentBackend::Channel {
+#ifdef _WIN32
+    HANDLE Pipe = INVALID_HANDLE_VALUE;
+    HANDLE Event = NULL;  // of the pipe's overlapped I/O
+#endif
+    SocketHandle Sock = INVALID_SOCKET;
+    std::unique_ptr<char[]> Area;
+    Clock::time_point LastUsed;
+
+    Channel() : Area(new char[SA_MAX_MESSAGE_LEN]) { }
+#ifdef _WIN32
+    ~Channel() {
+        if (Event)
+            CloseHandle(Event);
+    }
+#endif
+
+    bool IsConnected() const {
+#ifdef _WIN32
+        if (Pipe != INVALID_HANDLE_VALUE)
+            return true;
+#endif
+        return Sock != INVALID_SOCKET;
+    }
+};
+
+UpstreamAgentBackend::UpstreamAgentBackend(const std::string& path, size_t connections, size_t idleTimeoutMs,
+                                           size_t timeoutMs)
+    : Path(path)
+    , IdleTimeout(std::max<size_t>(idleTimeoutMs, 1))
+    , Timeout(std::max<size_t>(timeoutMs, 1))
+{
+    if (!IsNamedPipe(Path)) {
+        sockaddr_un addr;
+        if (Path.size() >= sizeof(addr.sun_path))
+            THROW_RUNTIME_ERROR("upstream agent path is too long: " << Path);
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData = {0};
+    if (int err = WSAStartup(MAKEWORD(2, 2), &wsaData))
+        THROW_RUNTIME_ERROR("WSAStartup failed: " << err);
+#endif
+
+    Channels.reserve(connections);
+    for (size_t i = 0; i < connections; ++i) {
+        Channels.emplace_back(new Channel());
+        Free.push_back(Channels.back().get());
+    }
+
+    Reaper = std::thread(&UpstreamAgentBackend::Reap, this);
+
+    // waits for a free connection tell whether there are enough of them
+    Metrics::AddSource(this, [this](std::ostream& os) {
+        const PoolStats stats = GetStats();
+        os << "upstream_connections " << Channels.size() << " acquisitions " << stats.Acquisitions
+           << " waits " << stats.Waits << " wait_us " << stats.WaitTimeNs / 1000 << " connects " << stats.Connects
+           << " dropped " << stats.Dropped << " reaped " << stats.Reaped << " max_busy " << stats.MaxBusy << '\n';
+    });
+}
+
+UpstreamAgentBackend::~UpstreamAgentBackend()
+{
+    Metrics::RemoveSource(this);
+    {
+        std::lock_guard<std::mutex> lock(Mtx);
+        ReapStop = true;
+    }
+    ReapCv.notify_all();
+    try { Reaper.join(); } catch (...) { }
+
+    for (const std::unique_ptr<Channel>& channel : Channels)
+        Disconnect(*channel);
+
+    LOG_DEBUG("Upstream agent connections: " << Stats.Acquisitions << " acquisitions, " << Stats.Waits
+              << " waited for " << Stats.WaitTimeNs / 1000 << " us in total, " << Stats.Connects << " connects, "
+              << Stats.Dropped << " dropped, " << Stats.Reaped << " reaped, max busy " << Stats.MaxBusy);
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+void UpstreamAgentBackend::Connect(Channel& channel)
+{
+#ifdef _WIN32
+    if (IsNamedPipe(Path)) {
+        if (!channel.Event) {
+            channel.Event = CreateEventA(NULL, TRUE, FALSE, NULL);
+            if (!channel.Event)
+                THROW_RUNTIME_ERROR("CreateEvent failed: " << GetLastError());
+        }
+        channel.Pipe = CreateFileA(Path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                                   FILE_FLAG_OVERLAPPED, NULL);
+        if (channel.Pipe == INVALID_HANDLE_VALUE)
+            THROW_RUNTIME_ERROR("couldn't open agent pipe " << Path << ": " << GetLastError());
+        LOG_DEBUG("Connected to upstream agent " << Path);
+        return;
+    }
+#endif
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, Path.c_str(), Path.size());
+
+    SocketHandle sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("unix socket failed: " << LastSocketError());
+
+    if (connect(sock, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        const int err = LastSocketError();
+        CloseSocket(sock);
+        THROW_RUNTIME_ERROR("couldn't connect to agent " << Path << ": " << err);
+    }
+
+#ifdef _WIN32
+    const DWORD timeout = DWORD(Timeout.count());
+#else
+    timeval timeout = {};
+    timeout.tv_sec = time_t(Timeout.count() / 1000);
+    timeout.tv_usec = suseconds_t(Timeout.count() % 1000 * 1000);
+#endif
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == SOCKET_ERROR
+            || setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == SOCKET_ERROR) {
+        const int err = LastSocketError();
+        CloseSocket(sock);
+        THROW_RUNTIME_ERROR("couldn't set agent socket timeouts: " << err);
+    }
+
+    channel.Sock = sock;
+    LOG_DEBUG("Connected to upstream agent " << Path);
+}
+
+UpstreamAgentBackend::PoolStats UpstreamAgentBackend::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    return Stats;
+}
+
+// an idle connection must have nothing to read: readiness means the agent has closed
+// it, it's broken or the agent sent something unexpected, none of which is usable
+bool UpstreamAgentBackend::IsAlive(const Channel& channel) const
+{
+#ifdef _WIN32
+    if (channel.Pipe != INVALID_HANDLE_VALUE) {
+        DWORD available = 0;
+        return PeekNamedPipe(channel.Pipe, NULL, 0, NULL, &available, NULL) && available == 0;
+    }
+
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(channel.Sock, &readable);
+    timeval noWait = {};
+    return select(0, &readable, NULL, NULL, &noWait) == 0;
+#else
+    char byte;
+    if (recv(channel.Sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != SOCKET_ERROR)
+        return false;
+    return IsWouldBlock(LastSocketError());
+#endif
+}
+
+void UpstreamAgentBackend::Drop(Channel& channel) noexcept
+{
+    if (!channel.IsConnected())
+        return;
+
+    Disconnect(channel);
+    std::lock_guard<std::mutex> lock(Mtx);
+    ++Stats.Dropped;
+}
+
+void UpstreamAgentBackend::Reap()
+{
+    std::unique_lock<std::mutex> lock(Mtx);
+    while (!ReapCv.wait_for(lock, IdleTimeout / 2, [this] { return ReapStop; })) {
+        const Clock::time_point now = Clock::now();
+        bool kept = false;
+        for (auto it = Free.rbegin(); it != Free.rend(); ++it) {
+            Channel& channel = **it;
+            if (!channel.IsConnected())
+                continue;
+
+            if (!IsAlive(channel)) {
+                Disconnect(channel);
+                ++Stats.Dropped;
+            } else if (kept && now - channel.LastUsed >= IdleTimeout) {
+                Disconnect(channel);
+                ++Stats.Reaped;
+            } else {
+                kept = true;  // the last used one stays open for the next ssh
+            }
+        }
+    }
+}
+
+void UpstreamAgentBackend::Disconnect(Channel& channel) noexcept
+{
+#ifdef _WIN32
+    if (channel.Pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(channel.Pipe);
+        channel.Pipe = INVALID_HANDLE_VALUE;
+    }
+#endif
+    if (channel.Sock != INVALID_SOCKET) {
+        CloseSocket(channel.Sock);
+        channel.Sock = INVALID_SOCKET;
+    }
+}
+
+bool UpstreamAgentBackend::Write(Channel& channel, const char* data, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+#ifdef _WIN32
+        if (channel.Pipe != INVALID_HANDLE_VALUE) {
+            DWORD written = 0;
+            const DWORD err = TransferPipe(channel.Pipe, channel.Event, true, const_cast<char*>(data + done),
+                                           DWORD(len - done), DWORD(Timeout.count()), written);
+            if (err == ERROR_BROKEN_PIPE || err == ERROR_NO_DATA)
+                return false;
+            if (err == WAIT_TIMEOUT)
+                THROW_RUNTIME_ERROR("agent pipe write timed out after " << Timeout.count() << " ms");
+            if (err != ERROR_SUCCESS)
+                THROW_RUNTIME_ERROR("agent pipe write failed: " << err);
+            done += written;
+            continue;
+        }
+#endif
+        int rc = send(channel.Sock, data + done, int(len - done), SEND_FLAGS);
+        if (rc == SOCKET_ERROR) {
+            const int err = LastSocketError();
+            if (IsClosedByPeer(err))
+                return false;
+            if (IsSocketTimeout(err))
+                THROW_RUNTIME_ERROR("agent socket send timed out after " << Timeout.count() << " ms");
+            THROW_RUNTIME_ERROR("agent socket send failed: " << err);
+        }
+        done += rc;
+    }
+    return true;
+}
+
+bool UpstreamAgentBackend::Read(Channel& channel, char* data, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        size_t got = 0;
+#ifdef _WIN32
+        if (channel.Pipe != INVALID_HANDLE_VALUE) {
+            DWORD read = 0;
+            const DWORD err = TransferPipe(channel.Pipe, channel.Event, false, data + done, DWORD(len - done),
+                                           DWORD(Timeout.count()), read);
+            if (err == WAIT_TIMEOUT)
+                THROW_RUNTIME_ERROR("agent pipe read timed out after " << Timeout.count() << " ms");
+            if (err != ERROR_SUCCESS && err != ERROR_BROKEN_PIPE)
+                THROW_RUNTIME_ERROR("agent pipe read failed: " << err);
+            got = read;
+        } else
+#endif
+        {
+            int rc = recv(channel.Sock, data + done, int(len - done), 0);
+            if (rc == SOCKET_ERROR) {
+                const int err = LastSocketError();
+                if (IsSocketTimeout(err))
+                    THROW_RUNTIME_ERROR("agent socket recv timed out after " << Timeout.count() << " ms");
+                if (!IsClosedByPeer(err))
+                    THROW_RUNTIME_ERROR("agent socket recv failed: " << err);
+                rc = 0;  // reset by the agent counts as closed
+            }
+            got = rc;
+        }
+
+        if (got == 0) {
+            if (done == 0)
+                return false;
+            THROW_RUNTIME_ERROR("upstream agent closed connection in the middle of a message");
+        }
+        done += got;
+    }
+    return true;
+}
+
+void UpstreamAgentBackend::Begin(Context& ctx)
+{
+    std::unique_lock<std::mutex> lock(Mtx);
+    ++Stats.Acquisitions;
+    if (Free.empty()) {
+        const auto start = Clock::now();
+        Cv.wait(lock, [this] { return !Free.empty(); });
+        ++Stats.Waits;
+        Stats.WaitTimeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    Channel* channel = Free.back();
+    Free.pop_back();
+    Stats.MaxBusy = std::max(Stats.MaxBusy, Channels.size() - Free.size());
+
+    ctx.Area = channel->Area.get();
+    ctx.Capacity = SA_MAX_MESSAGE_LEN;
+    ctx.Token = channel;
+}
+
+Buffer UpstreamAgentBackend::Query(Context& ctx, size_t len)
+{
+    Channel& channel = *static_cast<Channel*>(const_cast<void*>(ctx.Token));
+    try {
+        if (channel.IsConnected() && Clock::now() - channel.LastUsed >= std::chrono::milliseconds(UPSTREAM_CHECK_AFTER_MS)
+                && !IsAlive(channel))
+            Drop(channel);
+
+        // the agent may still have dropped the connection just now, then it's reopened once:
+        // sending fails with EPIPE or the answer with ECONNRESET or end of stream
+        bool reused = channel.IsConnected();
+        while (true) {
+            if (!channel.IsConnected()) {
+                Connect(channel);
+                std::lock_guard<std::mutex> lock(Mtx);
+                ++Stats.Connects;
+            }
+
+            if (Write(channel, ctx.Area, len) && Read(channel, ctx.Area, SA_HEADER_LEN))
+                break;
+
+            if (!reused)
+                THROW_RUNTIME_ERROR("upstream agent closed connection without answering");
+            Drop(channel);
+            reused = false;
+        }
+
+        const size_t respLen = SA_HEADER_LEN + SaMessageLen(ctx.Area);
+        if (respLen > ctx.Capacity)
+            THROW_RUNTIME_ERROR("upstream agent response message is too big: " << respLen);
+        if (!Read(channel, ctx.Area + SA_HEADER_LEN, respLen - SA_HEADER_LEN))
+            THROW_RUNTIME_ERROR("upstream agent closed connection in the middle of a message");
+
+        TRACE(UpstreamQuery, 0, len, respLen);
+        return Buffer(ctx.Area, respLen);
+    } catch (...) {
+        Drop(channel);
+        throw;
+    }
+}
+
+void UpstreamAgentBackend::End(Context& ctx) noexcept
+{
+    Channel* channel = static_cast<Channel*>(const_cast<void*>(ctx.Token));
+    {
+        std::lock_guard<std::mutex> lock(Mtx);
+        channel->LastUsed = Clock::now();
+        Free.push_back(channel);  // never reallocates
+    }
+    Cv.notify_one();
+}
+
+
+//------------------------------------------------------------------------------
+
+// an identity listing being fanned out, the answers are filled in by helpers
+struct MultiBackend::Listing {
+    const char* Req;
+    size_t Len;
+    std::vector<std::vector<char>> Answers;
+
+    std::mutex Mtx;
+    std::condition_variable Cv;
+    size_t Pending = 0;  // answers not filled in yet, guarded by Mtx
+};
+
+// lists identities of its backend for one listing after another
+struct MultiBackend::Helper {
+    std::mutex Mtx;
+    std::condition_variable Cv;
+    std::deque<Listing*> Jobs;  // guarded by Mtx
+    bool Stop = false;          // guarded by Mtx
+    std::thread Thread;
+};
+
+MultiBackend::MultiBackend(std::vector<std::unique_ptr<AgentBackend>>&& backends)
+    : Backends(std::move(backends))
+    , Areas(SA_MAX_MESSAGE_LEN, Config::Get().Workers, "multi_agent")
+{
+    if (Backends.empty())
+        THROW_RUNTIME_ERROR("no agent backends given");
+
+    try {
+        for (size_t i = 1; i < Backends.size(); ++i) {
+            Helpers.emplace_back(new Helper());
+            Helpers.back()->Thread = std::thread(&MultiBackend::RunHelper, this, i, std::ref(*Helpers.back()));
+        }
+    } catch (...) {
+        StopHelpers();
+        throw;
+    }
+}
+
+MultiBackend::~MultiBackend()
+{
+    StopHelpers();
+}
+
+void MultiBackend::StopHelpers() noexcept
+{
+    for (const std::unique_ptr<Helper>& helper : Helpers) {
+        {
+            std::lock_guard<std::mutex> lock(helper->Mtx);
+            helper->Stop = true;
+        }
+        helper->Cv.notify_all();
+        if (helper->Thread.joinable())
+            try { helper->Thread.join(); } catch (...) { }
+    }
+}
+
+void MultiBackend::RunHelper(size_t backend, Helper& helper)
+{
+    std::unique_lock<std::mutex> lock(helper.Mtx);
+    while (true) {
+        helper.Cv.wait(lock, [&helper] { return helper.Stop || !helper.Jobs.empty(); });
+        if (helper.Jobs.empty())
+            return;  // stopped
+
+        Listing* listing = helper.Jobs.front();
+        helper.Jobs.pop_front();
+        lock.unlock();
+
+        Fetch(backend, *listing);
+        {
+            // notified under the lock: the caller frees the listing as soon as it's done
+            std::lock_guard<std::mutex> done(listing->Mtx);
+            if (--listing->Pending == 0)
+                listing->Cv.notify_all();
+        }
+        lock.lock();
+    }
+}
+
+void MultiBackend::Fetch(size_t backend, Listing& listing) noexcept
+{
+    std::vector<char>& answer = listing.Answers[backend];
+    try {
+        answer.resize(SA_MAX_MESSAGE_LEN);
+        answer.resize(Forward(backend, listing.Req, listing.Len, answer.data(), answer.size()));
+    } catch (const std::exception& exc) {
+        LOG_ERROR("Listing identities of " << Backends[backend]->GetName() << " failed: " << exc.what());
+        answer.clear();
+    }
+}
+
+void MultiBackend::Begin(Context& ctx)
+{
+    ctx.Area = Areas.Acquire();
+    ctx.Capacity = Areas.GetBlockSize();
+    ctx.Token = nullptr;
+}
+
+void MultiBackend::End(Context& ctx) noexcept
+{
+    Areas.Release(ctx.Area);
+}
+
+Buffer MultiBackend::Query(Context& ctx, size_t len)
+{
+    const uint8_t type = SaMessageType(ctx.Area, len);
+    switch (type) {
+    case SSH2_AGENTC_REQUEST_IDENTITIES:
+        return ListIdentities(ctx, len);
+
+    case SSH2_AGENTC_SIGN_REQUEST:
+    case SSH2_AGENTC_REMOVE_IDENTITY: {
+        size_t pos = SA_HEADER_LEN + 1;
+        const char* blob = nullptr;
+        uint32_t size = 0;
+        if (ReadString(ctx.Area, len, pos, blob, size))
+            return Route(ctx, len, std::string(blob, size));
+        break;
+    }
+
+    case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+    case SSH_AGENTC_LOCK:
+    case SSH_AGENTC_UNLOCK:
+        return Broadcast(ctx, len);
+    }
+
+    return Buffer(ctx.Area, Forward(0, ctx.Area, len, ctx.Area, ctx.Capacity));
+}
+
+Buffer MultiBackend::ListIdentities(Context& ctx, size_t len)
+{
+    Listing listing;
+    listing.Req = ctx.Area;
+    listing.Len = len;
+    listing.Answers.resize(Backends.size());
+    listing.Pending = Helpers.size();
+    for (const std::unique_ptr<Helper>& helper : Helpers) {
+        {
+            std::lock_guard<std::mutex> lock(helper->Mtx);
+            helper->Jobs.push_back(&listing);
+        }
+        helper->Cv.notify_one();
+    }
+
+    Fetch(0, listing);
+    {
+        std::unique_lock<std::mutex> lock(listing.Mtx);
+        listing.Cv.wait(lock, [&listing] { return listing.Pending == 0; });
+    }
+    const std::vector<std::vector<char>>& answers = listing.Answers;
+
+    // entries are copied as is, the first owner of a key wins
+    std::unordered_map<std::string, size_t> owners;
+    size_t out = SA_HEADER_LEN + 1 + 4;
+    uint32_t count = 0;
+    bool answered = false;
+    for (size_t i = 0; i < answers.size(); ++i) {
+        const char* msg = answers[i].data();
+        const size_t msgLen = answers[i].size();
+        if (SaMessageType(msg, msgLen) != SSH2_AGENT_IDENTITIES_ANSWER)
+            continue;
+        answered = true;
+
+        size_t pos = SA_HEADER_LEN + 1;
+        uint32_t keys = 0;
+        ReadUint32(msg, msgLen, pos, keys);
+        for (uint32_t k = 0; k < keys; ++k) {
+            const size_t entry = pos;
+            const char* blob = nullptr;
+            const char* comment = nullptr;
+            uint32_t blobLen = 0, commentLen = 0;
+            if (!ReadString(msg, msgLen, pos, blob, blobLen) || !ReadString(msg, msgLen, pos, comment, commentLen))
+                break;
+            if (!owners.emplace(std::string(blob, blobLen), i).second)
+                continue;
+            if (pos - entry > ctx.Capacity - out)
+                break;
+
+            std::memcpy(ctx.Area + out, msg + entry, pos - entry);
+            out += pos - entry;
+            ++count;
+        }
+    }
+
+    if (!answered) {
+        std::memcpy(ctx.Area, FAILURE, sizeof(FAILURE));
+        return Buffer(ctx.Area, sizeof(FAILURE));
+    }
+
+    PutMessage(ctx.Area, SSH2_AGENT_IDENTITIES_ANSWER, out - SA_HEADER_LEN - 1);
+    PutUint32(ctx.Area + SA_HEADER_LEN + 1, count);
+    {
+        std::lock_guard<std::mutex> lock(Mtx);
+        Owners.swap(owners);
+    }
+    return Buffer(ctx.Area, out);
+}
+
+Buffer MultiBackend::Route(Context& ctx, size_t len, const std::string& key)
+{
+    size_t owner = Backends.size();
+    {
+        std::lock_guard<std::mutex> lock(Mtx);
+        auto it = Owners.find(key);
+        if (it != Owners.end())
+            owner = it->second;
+    }
+    if (owner < Backends.size())
+        return Buffer(ctx.Area, Forward(owner, ctx.Area, len, ctx.Area, ctx.Capacity));
+
+    // the key wasn't listed yet: the first agent not failing it becomes its owner;
+    // a failed agent is skipped, its answer is written to the area only on success
+    const std::vector<char> req(ctx.Area, ctx.Area + len);
+    for (size_t i = 0; i < Backends.size(); ++i) {
+        size_t respLen = 0;
+        try {
+            respLen = Forward(i, req.data(), len, ctx.Area, ctx.Capacity);
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Agent " << Backends[i]->GetName() << " failed: " << exc.what());
+            continue;
+        }
+        if (SaMessageType(ctx.Area, respLen) != SSH_AGENT_FAILURE) {
+            std::lock_guard<std::mutex> lock(Mtx);
+            Owners[key] = i;
+            return Buffer(ctx.Area, respLen);
+        }
+    }
+    std::memcpy(ctx.Area, FAILURE, sizeof(FAILURE));
+    return Buffer(ctx.Area, sizeof(FAILURE));
+}
+
+Buffer MultiBackend::Broadcast(Context& ctx, size_t len)
+{
+    const std::vector<char> req(ctx.Area, ctx.Area + len);
+    bool succeeded = false;
+    for (size_t i = 0; i < Backends.size(); ++i) {
+        try {
+            const size_t respLen = Forward(i, req.data(), len, ctx.Area, ctx.Capacity);
+            succeeded |= SaMessageType(ctx.Area, respLen) == SSH_AGENT_SUCCESS;
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Agent " << Backends[i]->GetName() << " failed: " << exc.what());
+        }
+    }
+    return Buffer(ctx.Area, PutMessage(ctx.Area, succeeded ? SSH_AGENT_SUCCESS : SSH_AGENT_FAILURE, 0));
+}
+
+// sends the request to one backend and copies its answer to `out`, returns the answer's length
+size_t MultiBackend::Forward(size_t backend, const char* req, size_t len, char* out, size_t capacity)
+{
+    AgentBackend& agent = *Backends[backend];
+    Context sub;
+    agent.Begin(sub);
+    try {
+        if (len > sub.Capacity)
+            THROW_RUNTIME_ERROR("request of " << len << " bytes doesn't fit to " << agent.GetName());
+
+        std::memcpy(sub.Area, req, len);
+        const Buffer resp = agent.Query(sub, len);
+        if (resp.len > capacity)
+            THROW_RUNTIME_ERROR("response of " << resp.len << " bytes doesn't fit");
+
+        std::memcpy(out, resp.ptr, resp.len);
+        agent.End(sub);
+        return resp.len;
+    } catch (...) {
+        agent.End(sub);
+        throw;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+
+StubBackend::StubBackend(unsigned latencyUs)
+    : LatencyUs(latencyUs)
+    , Areas(SA_MAX_MESSAGE_LEN, Config::Get().Workers, "stub_agent")
+{ }
+
+void StubBackend::Begin(Context& ctx)
+{
+    ctx.Area = Areas.Acquire();
+    ctx.Capacity = Areas.GetBlockSize();
+    ctx.Token = nullptr;
+}
+
+Buffer StubBackend::Query(Context& ctx, size_t len)
+{
+    if (LatencyUs)
+        std::this_thread::sleep_for(std::chrono::microseconds(LatencyUs));
+
+    const uint8_t type = SaMessageType(ctx.Area, len);
+    size_t respLen = 0;
+    switch (type) {
+    case SSH2_AGENTC_REQUEST_IDENTITIES:
+        respLen = PutMessage(ctx.Area, SSH2_AGENT_IDENTITIES_ANSWER, 4);
+        PutUint32(ctx.Area + SA_HEADER_LEN + 1, 0);
+        break;
+    case SSH2_AGENTC_SIGN_REQUEST:
+        respLen = PutMessage(ctx.Area, SSH2_AGENT_SIGN_RESPONSE, 4 + STUB_SIGNATURE_LEN);
+        PutUint32(ctx.Area + SA_HEADER_LEN + 1, STUB_SIGNATURE_LEN);
+        std::memset(ctx.Area + SA_HEADER_LEN + 5, 0, STUB_SIGNATURE_LEN);
+        break;
+    default:
+        respLen = PutMessage(ctx.Area, SaChangesIdentities(type) ? SSH_AGENT_SUCCESS : SSH_AGENT_FAILURE, 0);
+        break;
+    }
+    return Buffer(ctx.Area, respLen);
+}
+
+void StubBackend::End(Context& ctx) noexcept
+{
+    Areas.Release(ctx.Area);
+}
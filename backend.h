@@ -0,0 +1,203 @@
+#pragma once
+#include "common.h"
+#include "buffer_pool.h"
+#include "config.h"
+#include "network.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+    #include "pageant.h"
+#endif
+
+#define UPSTREAM_CHECK_AFTER_MS 1000    // a connection idle longer is checked for being closed before use
+#define STUB_SIGNATURE_LEN 83       // as of an ed25519 signature blob
+#define STUB_MAX_LATENCY_US 60000000  // a minute; a longer stub latency is a typo
+#define OPENSSH_AGENT_PIPE "\\\\.\\pipe\\openssh-ssh-agent"
+
+
+// Source of answers to ssh-agent requests, chosen at runtime by a spec:
+//   pageant                PuTTY's Pageant (default, Windows only)
+//   agent[:<path>]         upstream agent on a unix socket or a Windows named pipe
+//   stub[:<latency us>]    deterministic in-process answers, for load tests
+//   <spec>;<spec>...       several agents at once, see MultiBackend
+class AgentBackend : public Network::Handler {
+public:
+    virtual const char* GetName() const = 0;
+
+    static std::unique_ptr<AgentBackend> Create(const std::string& spec);
+};
+
+
+// Creates the backend by the spec on a background thread, so the caller can go on
+// (e.g. spawn ssh) meanwhile; requests wait until it's ready and rethrow its errors
+class DeferredBackend : public AgentBackend {
+public:
+    explicit DeferredBackend(const std::string& spec);
+
+    const char* GetName() const override { return Get().GetName(); }
+
+    void Begin(Context& ctx) override { Get().Begin(ctx); }
+    Buffer Query(Context& ctx, size_t len) override { return Get().Query(ctx, len); }
+    void End(Context& ctx) noexcept override { Get().End(ctx); }
+
+private:
+    AgentBackend& Get() const { return *Backend.get(); }
+
+private:
+    std::shared_future<std::unique_ptr<AgentBackend>> Backend;
+};
+
+
+#ifdef _WIN32
+// answers requests right in Pageant's shared memory
+class PageantBackend : public AgentBackend {
+public:
+    explicit PageantBackend(size_t channels = Config::Get().PageantChannels) : Agent(channels) { }
+
+    const char* GetName() const override { return "pageant"; }
+
+    void Begin(Context& ctx) override;
+    Buffer Query(Context& ctx, size_t len) override;
+    void End(Context& ctx) noexcept override;
+
+private:
+    Pageant Agent;
+};
+#endif
+
+
+// Relays requests to another ssh-agent (OpenSSH's one, a Linux agent...) over
+// a pool of persistent connections, each with its own request area. A request
+// has a connection to itself until it's answered, as the protocol is strictly
+// request/response. Connections are opened on demand and reused most recently
+// used first; a background thread closes the ones idle for long and those the
+// agent has closed, a connection idle for a while is also checked before use.
+// Sending a request and receiving its answer time out, so a hung agent fails
+// requests instead of holding their connections and workers forever.
+class UpstreamAgentBackend : public AgentBackend {
+public:
+    UpstreamAgentBackend(const UpstreamAgentBackend&) = delete;
+    UpstreamAgentBackend& operator =(const UpstreamAgentBackend&) = delete;
+
+    struct PoolStats {
+        uint64_t Acquisitions = 0;
+        uint64_t Waits = 0;       // acquisitions found no free connection
+        uint64_t WaitTimeNs = 0;  // total time spent waiting for a connection
+        uint64_t Connects = 0;
+        uint64_t Dropped = 0;     // found closed by the agent or broken
+        uint64_t Reaped = 0;      // closed for being idle
+        size_t MaxBusy = 0;       // connections in use at once
+    };
+
+public:
+    explicit UpstreamAgentBackend(const std::string& path, size_t connections = Config::Get().UpstreamConnections,
+                                  size_t idleTimeoutMs = Config::Get().UpstreamIdleMs,
+                                  size_t timeoutMs = Config::Get().UpstreamTimeoutMs);
+    ~UpstreamAgentBackend();
+
+    const char* GetName() const override { return "agent"; }
+
+    void Begin(Context& ctx) override;
+    Buffer Query(Context& ctx, size_t len) override;
+    void End(Context& ctx) noexcept override;
+
+    PoolStats GetStats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Channel;
+
+    void Connect(Channel& channel);
+    void Disconnect(Channel& channel) noexcept;
+    bool IsAlive(const Channel& channel) const;  // without a round trip
+    void Drop(Channel& channel) noexcept;
+    bool Write(Channel& channel, const char* data, size_t len);  // false if closed by the agent
+    bool Read(Channel& channel, char* data, size_t len);  // false if closed before any data
+    void Reap();
+
+private:
+    const std::string Path;
+    const std::chrono::milliseconds IdleTimeout;
+    const std::chrono::milliseconds Timeout;
+    std::vector<std::unique_ptr<Channel>> Channels;
+
+    mutable std::mutex Mtx;
+    std::condition_variable Cv;
+    std::vector<Channel*> Free;  // the most recently used at the back, guarded by Mtx
+    PoolStats Stats;             // guarded by Mtx
+
+    std::condition_variable ReapCv;
+    bool ReapStop = false;  // guarded by Mtx
+    std::thread Reaper;
+};
+
+
+// Combines keys of several agents: identity listings are fanned out to all of them
+// in parallel, merged and deduplicated (the first agent listing a key owns it); sign
+// and remove requests go to the key's owner, found in an index by the key blob.
+// New keys are added to the first agent, lock and remove-all go to every one.
+// The caller lists the first agent itself, every other one has a helper thread.
+class MultiBackend : public AgentBackend {
+public:
+    MultiBackend(const MultiBackend&) = delete;
+    MultiBackend& operator =(const MultiBackend&) = delete;
+
+public:
+    explicit MultiBackend(std::vector<std::unique_ptr<AgentBackend>>&& backends);
+    ~MultiBackend();
+
+    const char* GetName() const override { return "multi"; }
+
+    void Begin(Context& ctx) override;
+    Buffer Query(Context& ctx, size_t len) override;
+    void End(Context& ctx) noexcept override;
+
+private:
+    struct Listing;
+    struct Helper;
+
+    Buffer ListIdentities(Context& ctx, size_t len);
+    Buffer Route(Context& ctx, size_t len, const std::string& key);
+    Buffer Broadcast(Context& ctx, size_t len);
+
+    size_t Forward(size_t backend, const char* req, size_t len, char* out, size_t capacity);
+    void Fetch(size_t backend, Listing& listing) noexcept;
+    void RunHelper(size_t backend, Helper& helper);
+    void StopHelpers() noexcept;
+
+private:
+    std::vector<std::unique_ptr<AgentBackend>> Backends;
+    std::vector<std::unique_ptr<Helper>> Helpers;  // of Backends[1...]
+    BufferPool Areas;
+
+    std::mutex Mtx;
+    std::unordered_map<std::string, size_t> Owners;  // key blob to backend, guarded by Mtx
+};
+
+
+// Answers without any agent behind it: no identities, a fixed dummy signature,
+// success for key management and failure for the rest, after a configurable delay
+class StubBackend : public AgentBackend {
+public:
+    explicit StubBackend(unsigned latencyUs = 0);
+
+    const char* GetName() const override { return "stub"; }
+
+    void Begin(Context& ctx) override;
+    Buffer Query(Context& ctx, size_t len) override;
+    void End(Context& ctx) noexcept override;
+
+private:
+    const unsigned LatencyUs;
+    BufferPool Areas;
+};
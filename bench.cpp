@@ -0,0 +1,466 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "agent_proto.h"
+#include "buffer_pool.h"
+#include "framer.h"
+#include "network.h"
+#include "poller.h"
+#include "scheduler.h"
+#include "common.h"
+
+#ifdef _WIN32
+    #include <Windows.h>
+    #include "pageant.h"
+#else
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/mman.h>
+#endif
+
+#define BENCH_MIN_TIME_MS 100   // of one run, iterations are doubled until it's reached
+#define BENCH_RUNS 5            // the median run is reported
+#define BENCH_MESSAGE_LEN 256   // a typical sign request with its header
+#define BENCH_BATCH 32          // messages in flight in the framing benchmark
+#define BENCH_RESPONSE_LEN 700  // an RSA-4096 signature response
+#define BENCH_THREADS 4         // contending in the handoff benchmark
+
+// Microbenchmarks of the request path. Results go to stdout as JSON, one object per
+// benchmark with nanoseconds per operation, so runs can be compared between releases.
+const char* const USAGE = "usage: ssh-pageant-wrap-bench [<name substring>]";
+
+namespace {
+
+struct Result {
+    std::string Name;
+    uint64_t Iterations;  // per run
+    double NsPerOp;
+    double BytesPerOp;    // zero if the benchmark doesn't move data
+};
+
+// doubles iterations of `op` until a run takes long enough, then reports the median of such runs
+Result Measure(const std::string& name, double bytesPerOp, const std::function<void(uint64_t)>& op) {
+    using Clock = std::chrono::steady_clock;
+    const auto minTime = std::chrono::milliseconds(BENCH_MIN_TIME_MS);
+
+    uint64_t iterations = 1;
+    while (true) {
+        const auto start = Clock::now();
+        op(iterations);
+        if (Clock::now() - start >= minTime || iterations >= (uint64_t(1) << 40))
+            break;
+        iterations *= 2;
+    }
+
+    std::vector<Result> runs;
+    for (unsigned i = 0; i < BENCH_RUNS; ++i) {
+        const auto start = Clock::now();
+        op(iterations);
+        const double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+        runs.push_back(Result{ name, iterations, ns / iterations, bytesPerOp });
+    }
+
+    std::sort(runs.begin(), runs.end(), [](const Result& a, const Result& b) { return a.NsPerOp < b.NsPerOp; });
+    return runs[runs.size() / 2];
+}
+
+
+// connected loopback TCP sockets, the way Cygwin clients come
+struct SocketPair {
+    SocketHandle Client = INVALID_SOCKET;
+    SocketHandle Server = INVALID_SOCKET;
+
+    SocketPair();
+    ~SocketPair() { CloseSocket(Client); CloseSocket(Server); }
+};
+
+SocketPair::SocketPair()
+{
+    SocketHandle listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("socket failed: " << LastSocketError());
+
+    sockaddr_in addr = {};
+    SockLen addrLen = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    Client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (Client == INVALID_SOCKET
+            || bind(listener, (const sockaddr*)&addr, addrLen) == SOCKET_ERROR
+            || getsockname(listener, (sockaddr*)&addr, &addrLen) == SOCKET_ERROR
+            || listen(listener, 1) == SOCKET_ERROR
+            || connect(Client, (const sockaddr*)&addr, addrLen) == SOCKET_ERROR
+            || (Server = accept(listener, nullptr, nullptr)) == INVALID_SOCKET) {
+        const int err = LastSocketError();
+        CloseSocket(listener);
+        if (Client != INVALID_SOCKET)
+            CloseSocket(Client);
+        THROW_RUNTIME_ERROR("socket pair setup failed: " << err);
+    }
+    CloseSocket(listener);
+}
+
+void SendAll(SocketHandle sock, const char* data, size_t len) {
+    for (size_t sent = 0; sent < len; ) {
+        const int rc = send(sock, data + sent, int(len - sent), 0);
+        if (rc == SOCKET_ERROR)
+            THROW_RUNTIME_ERROR("send failed: " << LastSocketError());
+        sent += rc;
+    }
+}
+
+void RecvAll(SocketHandle sock, char* data, size_t len) {
+    for (size_t received = 0; received < len; ) {
+        const int rc = recv(sock, data + received, int(len - received), 0);
+        if (rc <= 0)
+            THROW_RUNTIME_ERROR("recv failed: " << LastSocketError());
+        received += rc;
+    }
+}
+
+// pipelined sign requests of BENCH_MESSAGE_LEN bytes
+std::vector<char> MakeBatch() {
+    std::vector<char> batch(BENCH_BATCH * BENCH_MESSAGE_LEN);
+    for (size_t i = 0; i < batch.size(); i += BENCH_MESSAGE_LEN) {
+        const uint32_t len = htonl(BENCH_MESSAGE_LEN - SA_HEADER_LEN);
+        std::memcpy(&batch[i], &len, sizeof(len));
+        batch[i + SA_HEADER_LEN] = char(SSH2_AGENTC_SIGN_REQUEST);
+    }
+    return batch;
+}
+
+// a batch of pipelined messages is sent and framed by the receiving side
+Result BenchFraming() {
+    SocketPair pair;
+    const std::vector<char> batch = MakeBatch();
+
+    const size_t size = Config::Get().BufferSize;
+    std::vector<char> in(size), out(size);
+    Framer frames;
+    frames.Attach(in.data(), out.data(), size);
+
+    return Measure("framing/loopback_tcp", BENCH_MESSAGE_LEN, [&](uint64_t iterations) {
+        for (uint64_t done = 0; done < iterations; ) {
+            const size_t count = size_t(std::min<uint64_t>(BENCH_BATCH, iterations - done));
+            SendAll(pair.Client, batch.data(), count * BENCH_MESSAGE_LEN);
+
+            for (size_t framed = 0; framed < count; ) {
+                if (const size_t len = frames.PeekMessage()) {
+                    frames.Consume(len);
+                    ++framed;
+                    continue;
+                }
+                const int rc = recv(pair.Server, frames.GetSpace(), int(frames.GetSpaceLen()), 0);
+                if (rc <= 0)
+                    THROW_RUNTIME_ERROR("recv failed: " << LastSocketError());
+                frames.Received(rc);
+            }
+            done += count;
+        }
+    });
+}
+
+// the same with the connection's input as it was before Framer: a fixed buffer
+// the message length is checked against, and the framed message is moved out of
+Result BenchFramingFixedBuffer() {
+    SocketPair pair;
+    const std::vector<char> batch = MakeBatch();
+
+    const size_t size = Config::Get().BufferSize;
+    std::vector<char> in(size);
+    size_t inLen = 0;
+
+    return Measure("framing/loopback_tcp_fixed_buffer", BENCH_MESSAGE_LEN, [&](uint64_t iterations) {
+        for (uint64_t done = 0; done < iterations; ) {
+            const size_t count = size_t(std::min<uint64_t>(BENCH_BATCH, iterations - done));
+            SendAll(pair.Client, batch.data(), count * BENCH_MESSAGE_LEN);
+
+            for (size_t framed = 0; framed < count; ) {
+                if (inLen >= SA_HEADER_LEN) {
+                    const size_t len = SaMessageLen(in.data());
+                    if (len > size - SA_HEADER_LEN)
+                        THROW_RUNTIME_ERROR("sizeof of SA message is too big: " << len);
+                    if (inLen >= SA_HEADER_LEN + len) {
+                        inLen -= SA_HEADER_LEN + len;
+                        if (inLen)
+                            std::memmove(in.data(), in.data() + SA_HEADER_LEN + len, inLen);
+                        ++framed;
+                        continue;
+                    }
+                }
+                const int rc = recv(pair.Server, in.data() + inLen, int(size - inLen), 0);
+                if (rc <= 0)
+                    THROW_RUNTIME_ERROR("recv failed: " << LastSocketError());
+                inLen += rc;
+            }
+            done += count;
+        }
+    });
+}
+
+// a response goes out behind output still queued for a pipelining client: before
+// Framer it was copied after the queued output and sent, now both go with one
+// gathering call right from where they are
+Result BenchRespond(bool gather) {
+    SocketPair pair;
+    std::vector<char> queued(BENCH_RESPONSE_LEN, 'q'), resp(BENCH_RESPONSE_LEN, 'r');
+    std::vector<char> out(Config::Get().BufferSize), sink(2 * BENCH_RESPONSE_LEN);
+    const Buffer parts[] = { Buffer(queued.data(), queued.size()), Buffer(resp.data(), resp.size()) };
+
+    return Measure(gather ? "respond/gather" : "respond/copy_then_send", 2 * BENCH_RESPONSE_LEN,
+                   [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            if (gather) {
+                if (SendGather(pair.Server, parts, 2) != int(sink.size()))
+                    THROW_RUNTIME_ERROR("gathered send failed: " << LastSocketError());
+            } else {
+                std::memcpy(out.data(), queued.data(), queued.size());
+                std::memcpy(out.data() + queued.size(), resp.data(), resp.size());
+                SendAll(pair.Server, out.data(), sink.size());
+            }
+            RecvAll(pair.Client, sink.data(), sink.size());
+        }
+    });
+}
+
+Result BenchRespondCopy() { return BenchRespond(false); }
+Result BenchRespondGather() { return BenchRespond(true); }
+
+Result BenchHexBuffer() {
+    std::vector<char> data(BENCH_MESSAGE_LEN);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = char(i * 7);
+
+    std::ostringstream os;
+    return Measure("hex_buffer/256", BENCH_MESSAGE_LEN, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            os.str(std::string());
+            os << HexBuffer(data.data(), data.size());
+        }
+    });
+}
+
+
+// Pageant's channel stand-in: a shared anonymous file mapping on Windows, mmap elsewhere
+class SharedRegion {
+public:
+    SharedRegion(const SharedRegion&) = delete;
+    SharedRegion& operator =(const SharedRegion&) = delete;
+
+public:
+    explicit SharedRegion(size_t size);
+    ~SharedRegion();
+
+    char* GetView() const { return View; }
+
+private:
+    char* View = nullptr;
+    size_t Size;
+#ifdef _WIN32
+    HANDLE Handle = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+
+SharedRegion::SharedRegion(size_t size)
+    : Size(size)
+{
+    Handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, DWORD(size), NULL);
+    if (!Handle)
+        THROW_RUNTIME_ERROR("CreateFileMapping failed: " << GetLastError());
+    View = static_cast<char*>(MapViewOfFile(Handle, FILE_MAP_WRITE, 0, 0, 0));
+    if (!View) {
+        CloseHandle(Handle);
+        THROW_RUNTIME_ERROR("MapViewOfFile failed: " << GetLastError());
+    }
+}
+
+SharedRegion::~SharedRegion()
+{
+    UnmapViewOfFile(View);
+    CloseHandle(Handle);
+}
+
+#else
+
+SharedRegion::SharedRegion(size_t size)
+    : Size(size)
+{
+    void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (view == MAP_FAILED)
+        THROW_RUNTIME_ERROR("mmap failed: " << errno);
+    View = static_cast<char*>(view);
+}
+
+SharedRegion::~SharedRegion()
+{
+    munmap(View, Size);
+}
+
+#endif
+
+// what Pageant::Query() does around the window message: the request is copied into
+// the channel and the response, found by its header, is copied back
+Result BenchChannelCopy() {
+    SharedRegion channel(SA_MAX_MESSAGE_LEN);
+    std::vector<char> msg(SA_MAX_MESSAGE_LEN);
+    const uint32_t respLen = htonl(BENCH_RESPONSE_LEN - SA_HEADER_LEN);
+
+    return Measure("channel_copy/request_256_response_700", BENCH_MESSAGE_LEN + BENCH_RESPONSE_LEN,
+                   [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            std::memcpy(channel.GetView(), msg.data(), BENCH_MESSAGE_LEN);
+            std::memcpy(channel.GetView(), &respLen, sizeof(respLen));  // "Pageant" answers in place
+            const size_t len = SA_HEADER_LEN + SaMessageLen(channel.GetView());
+            std::memcpy(msg.data(), channel.GetView(), len);
+        }
+    });
+}
+
+#ifdef _WIN32
+Result BenchMakeError() {
+    std::vector<char> data(BENCH_MESSAGE_LEN);
+    return Measure("pageant/make_error", 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i) {
+            Buffer msg(data.data(), data.size());
+            Pageant::MakeError(msg);
+        }
+    });
+}
+#endif
+
+
+// answers right away, so only the scheduler's cost is measured;
+// every benchmark thread passes its index as the connection id
+class EchoHandler : public Network::Handler {
+public:
+    void Begin(Context& ctx) override {
+        ctx.Area = Areas[ctx.Conn % BENCH_THREADS];
+        ctx.Capacity = BENCH_MESSAGE_LEN;
+    }
+    Buffer Query(Context&, size_t) override {
+        static const char success[] = { 0, 0, 0, 1, SSH_AGENT_SUCCESS };
+        return Buffer(const_cast<char*>(success), sizeof(success));
+    }
+    void End(Context&) noexcept override { }
+
+private:
+    char Areas[BENCH_THREADS][BENCH_MESSAGE_LEN];
+};
+
+void Schedule(Scheduler& scheduler, unsigned thread, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        Network::Handler::Context ctx;
+        ctx.Conn = thread;
+        scheduler.Begin(ctx);
+        ctx.Area[SA_HEADER_LEN] = char(SSH2_AGENTC_SIGN_REQUEST);
+        scheduler.Query(ctx, SA_HEADER_LEN + 1);
+        scheduler.End(ctx);
+    }
+}
+
+// admission of a request to the backend with nobody else around
+Result BenchSchedulerUncontended() {
+    EchoHandler echo;
+    Scheduler scheduler(echo);
+    return Measure("scheduler/uncontended", 0, [&](uint64_t iterations) { Schedule(scheduler, 0, iterations); });
+}
+
+// threads take turns in a single slot, so nearly every admission is a handoff
+// through the mutex and condition variable, like requests waiting for Pageant
+Result BenchSchedulerHandoff() {
+    EchoHandler echo;
+    Scheduler scheduler(echo, 1, BENCH_THREADS);
+    const std::string name = "scheduler/handoff_" + std::to_string(BENCH_THREADS) + "_threads";
+    return Measure(name, 0, [&](uint64_t iterations) {
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < BENCH_THREADS; ++t)
+            threads.emplace_back(Schedule, std::ref(scheduler), t, (iterations + t) / BENCH_THREADS);
+        for (std::thread& thread : threads)
+            thread.join();
+    });
+}
+
+// connection buffers are checked out of the pool on every accept
+Result BenchBufferPool() {
+    BufferPool pool(Config::Get().BufferSize, 2);
+    return Measure("buffer_pool/acquire_release", 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; ++i)
+            pool.Release(pool.Acquire());
+    });
+}
+
+
+void Print(std::ostream& os, const std::vector<Result>& results) {
+    os << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        os << (i ? ",\n" : "\n") << std::fixed << std::setprecision(2)
+           << "    {\"name\": \"" << r.Name << "\", \"iterations\": " << r.Iterations
+           << ", \"ns_per_op\": " << r.NsPerOp << ", \"ops_per_second\": " << 1e9 / r.NsPerOp;
+        if (r.BytesPerOp > 0)
+            os << ", \"bytes_per_second\": " << r.BytesPerOp * 1e9 / r.NsPerOp;
+        os << "}";
+    }
+    os << "\n  ]\n}" << std::endl;
+}
+
+}  // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+    if (argc > 2) {
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+    const std::string filter = argc > 1 ? argv[1] : "";
+
+    const std::pair<const char*, Result (*)()> benchmarks[] = {
+        { "framing/loopback_tcp", BenchFraming },
+        { "framing/loopback_tcp_fixed_buffer", BenchFramingFixedBuffer },
+        { "respond/copy_then_send", BenchRespondCopy },
+        { "respond/gather", BenchRespondGather },
+        { "hex_buffer/256", BenchHexBuffer },
+        { "channel_copy/request_256_response_700", BenchChannelCopy },
+#ifdef _WIN32
+        { "pageant/make_error", BenchMakeError },
+#endif
+        { "scheduler/uncontended", BenchSchedulerUncontended },
+        { "scheduler/handoff", BenchSchedulerHandoff },
+        { "buffer_pool/acquire_release", BenchBufferPool },
+    };
+
+    try {
+#ifdef _WIN32
+        WSADATA wsaData = {0};
+        if (int err = WSAStartup(MAKEWORD(2, 2), &wsaData))
+            THROW_RUNTIME_ERROR("WSAStartup failed: " << err);
+#endif
+
+        std::vector<Result> results;
+        for (const auto& bench : benchmarks) {
+            if (std::string(bench.first).find(filter) != std::string::npos)
+                results.push_back(bench.second());
+        }
+        Print(std::cout, results);
+        return 0;
+    } catch (const std::exception& exc) {
+        std::cerr << exc.what() << std::endl;
+    }
+    return -1;
+}
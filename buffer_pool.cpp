@@ -0,0 +1,84 @@
+#include "buffer_pool.h"
+#include "metrics.h"
+#include "common.h"
+
+#include <cstdint>
+
+
+BufferPool::BufferPool(size_t blockSize, size_t preallocBlocks, const char* name)
+    : BlockSize((blockSize + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+    , Name(name)
+{
+    if (preallocBlocks)
+        AddChunk(preallocBlocks);
+    Counters.Misses = 0;  // preallocation isn't a miss
+
+    if (Name) {
+        Metrics::AddSource(this, [this](std::ostream& os) {
+            const Stats stats = GetStats();
+            os << "buffer_pool " << Name << " block_size " << BlockSize << " blocks " << stats.Blocks
+               << " in_use " << stats.InUse << " high_water " << stats.HighWater << " acquired " << stats.Acquired
+               << " misses " << stats.Misses << '\n';
+        });
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    if (Name)
+        Metrics::RemoveSource(this);
+    if (Counters.InUse)
+        LOG_ERROR("Buffer pool destroyed with " << Counters.InUse << " blocks in use");
+
+    LOG_DEBUG("Buffer pool: " << Counters.Blocks << " blocks of " << BlockSize << " bytes, "
+              << Counters.Acquired << " acquired, high-water mark " << Counters.HighWater
+              << ", misses " << Counters.Misses);
+}
+
+BufferPool::Stats BufferPool::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    return Counters;
+}
+
+// must be called with Mtx held
+void BufferPool::AddChunk(size_t blocks)
+{
+    std::unique_ptr<char[]> chunk(new char[blocks * BlockSize + CACHE_LINE_SIZE - 1]);
+
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(chunk.get());
+    char* p = chunk.get() + (CACHE_LINE_SIZE - addr % CACHE_LINE_SIZE) % CACHE_LINE_SIZE;
+
+    Free.reserve(Counters.Blocks + blocks);
+    for (size_t i = 0; i < blocks; ++i, p += BlockSize)
+        Free.push_back(p);
+
+    Chunks.push_back(std::move(chunk));
+    Counters.Blocks += blocks;
+    ++Counters.Misses;
+}
+
+char* BufferPool::Acquire()
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    if (Free.empty())
+        AddChunk(1);
+
+    char* block = Free.back();
+    Free.pop_back();
+
+    ++Counters.Acquired;
+    if (++Counters.InUse > Counters.HighWater)
+        Counters.HighWater = Counters.InUse;
+    return block;
+}
+
+void BufferPool::Release(char* block) noexcept
+{
+    if (!block)
+        return;
+
+    std::lock_guard<std::mutex> lock(Mtx);
+    Free.push_back(block);  // never reallocates: capacity covers all blocks
+    --Counters.InUse;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+// Fixed size, cache line aligned blocks recycled through a free list.
+// Blocks are carved from preallocated chunks; when the pool runs dry a new
+// block is allocated (a miss) and stays in the pool afterwards. A named pool has
+// its counters dumped with the metrics, to tell whether preallocation suits the load.
+class BufferPool {
+public:
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator =(const BufferPool&) = delete;
+
+    struct Stats {
+        size_t Blocks = 0;     // allocated so far
+        size_t InUse = 0;
+        size_t HighWater = 0;  // max of InUse
+        size_t Acquired = 0;
+        size_t Misses = 0;     // acquisitions that had to allocate
+    };
+
+public:
+    BufferPool(size_t blockSize, size_t preallocBlocks, const char* name = nullptr);
+    ~BufferPool();
+
+    size_t GetBlockSize() const { return BlockSize; }
+    Stats GetStats() const;
+
+    char* Acquire();
+    void Release(char* block) noexcept;
+
+private:
+    void AddChunk(size_t blocks);
+
+private:
+    const size_t BlockSize;  // rounded up to the cache line
+    const char* const Name;
+
+    mutable std::mutex Mtx;
+    std::vector<std::unique_ptr<char[]>> Chunks;
+    std::vector<char*> Free;
+    Stats Counters;
+};
@@ -0,0 +1,57 @@
+#include "capture.h"
+#include "agent_proto.h"
+#include "metrics.h"
+
+#include <cstring>
+
+#define CAPTURE_FILE_BUFFER (256 * 1024)
+
+
+Recorder::Recorder(Network::Handler& upstream, const std::string& path, bool redact)
+    : Upstream(upstream)
+    , Redact(redact)
+    , Start(Metrics::Now())
+{
+    Output = std::fopen(path.c_str(), "wb");
+    if (!Output)
+        THROW_RUNTIME_ERROR("Couldn't open capture file " << path);
+
+    std::setvbuf(Output, nullptr, _IOFBF, CAPTURE_FILE_BUFFER);
+    std::fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), Output);
+    LOG_DEBUG("Agent traffic is captured to " << path << (Redact ? " (redacted)" : ""));
+}
+
+Recorder::~Recorder()
+{
+    std::fclose(Output);
+}
+
+void Recorder::Flush() noexcept
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    std::fflush(Output);
+}
+
+void Recorder::Write(CaptureKind kind, uint32_t conn, const void* msg, size_t len) noexcept
+{
+    const size_t stored = Redact && len > SA_HEADER_LEN + 1 ? SA_HEADER_LEN + 1 : len;
+
+    std::lock_guard<std::mutex> lock(Mtx);
+    CaptureRecord rec = {};
+    rec.Time = Metrics::Now() - Start;  // taken under the lock, so records are in time order
+    rec.Conn = conn;
+    rec.Len = uint32_t(len);
+    rec.Stored = uint32_t(stored);
+    rec.Kind = uint8_t(kind);
+
+    std::fwrite(&rec, sizeof(rec), 1, Output);
+    std::fwrite(msg, 1, stored, Output);
+}
+
+Buffer Recorder::Query(Context& ctx, size_t len)
+{
+    Write(CaptureKind::Request, ctx.Conn, ctx.Area, len);
+    const Buffer resp = Upstream.Query(ctx, len);
+    Write(CaptureKind::Response, ctx.Conn, resp.ptr, resp.len);
+    return resp;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "common.h"
+#include "network.h"
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// Capture file: the magic followed by records, each one followed by its stored bytes
+#define CAPTURE_MAGIC "SPWCAP1"
+
+enum class CaptureKind : uint8_t {
+    Request,
+    Response,
+};
+
+struct CaptureRecord {
+    uint64_t Time;    // nanoseconds since capture started
+    uint32_t Conn;
+    uint32_t Len;     // of the message
+    uint32_t Stored;  // bytes following the record, less than Len if redacted
+    uint8_t Kind;     // CaptureKind
+    uint8_t Reserved[3];
+};
+static_assert(sizeof(CaptureRecord) == 24, "capture record layout");
+
+
+// Appends every message passing through to a capture file for offline replay.
+// Redacted captures keep only the header and the type of messages.
+class Recorder : public Network::Handler {
+public:
+    Recorder(const Recorder&) = delete;
+    Recorder& operator =(const Recorder&) = delete;
+
+public:
+    Recorder(Network::Handler& upstream, const std::string& path, bool redact);
+    ~Recorder();
+
+    void Begin(Context& ctx) override { Upstream.Begin(ctx); }
+    Buffer Query(Context& ctx, size_t len) override;
+    void End(Context& ctx) noexcept override { Upstream.End(ctx); }
+
+    // writes out everything recorded so far, for exits which skip destructors
+    void Flush() noexcept;
+
+private:
+    void Write(CaptureKind kind, uint32_t conn, const void* msg, size_t len) noexcept;
+
+private:
+    Network::Handler& Upstream;
+    const bool Redact;
+    const uint64_t Start;
+
+    std::mutex Mtx;
+    FILE* Output = nullptr;  // guarded by Mtx
+};
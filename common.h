@@ -20,6 +20,8 @@
     std::cerr << "[ERR] " << msg << std::endl; \
 } catch(...) { }
 
+#define CACHE_LINE_SIZE 64
+
 #define THROW_RUNTIME_ERROR(msg) do { \
     std::ostringstream os; os << msg; \
     throw std::runtime_error(os.str()); \
@@ -0,0 +1,167 @@
+#include "config.h"
+#include "agent_proto.h"
+#include "common.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+
+#ifndef GIT_SSH_PATH
+    #define GIT_SSH_PATH ""  // set by CMake for the wrapper only
+#endif
+
+#define CONFIG_ENV_PREFIX "SSH_PAGEANT_WRAP_"
+
+namespace {
+
+struct Setting {
+    const char* Name;  // in the file, upper-cased in the environment
+    size_t Config::* Number;
+    std::string Config::* Text;
+    size_t Min;
+    size_t Max;
+};
+
+const size_t UNLIMITED = size_t(-1);
+
+const Setting SETTINGS[] = {
+    { "buffer_size",           &Config::BufferSize,           nullptr, 1024, SA_MAX_MESSAGE_LEN },
+    { "workers",               &Config::Workers,              nullptr, 1, 256 },
+    { "pooled_connections",    &Config::PooledConnections,    nullptr, 0, 65536 },
+    { "max_connections",       &Config::MaxConnections,       nullptr, 1, 65536 },
+    { "backlog",               &Config::Backlog,              nullptr, 1, 65535 },
+    { "drain_ms",              &Config::DrainMs,              nullptr, 0, 600000 },
+    { "pageant_channels",      &Config::PageantChannels,      nullptr, 1, 256 },
+    { "pageant_channel_size",  &Config::PageantChannelSize,   nullptr, 8192, SA_MAX_MESSAGE_LEN },
+    { "pageant_retries",       &Config::PageantRetries,       nullptr, 1, 100 },
+    { "pageant_timeout_ms",    &Config::PageantTimeoutMs,     nullptr, 100, 3600000 },
+    { "scheduler_concurrency", &Config::SchedulerConcurrency, nullptr, 1, 256 },
+    { "scheduler_queue_limit", &Config::SchedulerQueueLimit,  nullptr, 0, 65536 },
+    { "listing_delay_ms",      &Config::ListingDelayMs,       nullptr, 0, 600000 },
+    { "identity_ttl_ms",       &Config::IdentityTtlMs,        nullptr, 0, 86400000 },
+    { "upstream_connections",  &Config::UpstreamConnections,  nullptr, 1, 256 },
+    { "upstream_idle_ms",      &Config::UpstreamIdleMs,       nullptr, 1, 86400000 },
+    { "upstream_timeout_ms",   &Config::UpstreamTimeoutMs,    nullptr, 100, 3600000 },
+    { "metrics_interval_ms",   &Config::MetricsIntervalMs,    nullptr, 100, 86400000 },
+    { "git_ssh",               nullptr,                       &Config::GitSsh, 0, UNLIMITED },
+};
+
+std::string Trim(const std::string& s) {
+    const size_t begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+        return std::string();
+    return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+// false if the value doesn't suit the setting, then it's left as is
+bool Assign(Config& cfg, const Setting& setting, const std::string& value) {
+    if (setting.Text) {
+        cfg.*setting.Text = value;
+        return true;
+    }
+
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long long number = std::strtoull(value.c_str(), &end, 10);
+    if (value.empty() || *end || errno || value[0] == '-' || number < setting.Min || number > setting.Max) {
+        LOG_ERROR("Setting " << setting.Name << " = " << value << " is ignored, expected a number from "
+                  << setting.Min << " to " << setting.Max);
+        return false;
+    }
+    cfg.*setting.Number = size_t(number);
+    return true;
+}
+
+}  // anonymous namespace
+
+
+Config::Config()
+    : BufferSize(BUFF_SIZE)
+    , Workers(NETWORK_WORKERS)
+    , PooledConnections(BUFF_POOL_CONNECTIONS)
+    , MaxConnections(NETWORK_MAX_CONNECTIONS)
+    , Backlog(NETWORK_BACKLOG)
+    , DrainMs(NETWORK_DRAIN_MS)
+    , PageantChannels(PAGEANT_CHANNELS)
+    , PageantChannelSize(SA_MAX_MESSAGE_LEN)
+    , PageantRetries(PAGEANT_RETRIES)
+    , PageantTimeoutMs(PAGEANT_QUERY_TIMEOUT_MS)
+    , SchedulerConcurrency(SCHEDULER_CONCURRENCY)
+    , SchedulerQueueLimit(SCHEDULER_QUEUE_LIMIT)
+    , ListingDelayMs(SCHEDULER_LISTING_DELAY_MS)
+    , IdentityTtlMs(IDENTITY_CACHE_TTL_MS)
+    , UpstreamConnections(UPSTREAM_CONNECTIONS)
+    , UpstreamIdleMs(UPSTREAM_IDLE_TIMEOUT_MS)
+    , UpstreamTimeoutMs(UPSTREAM_TIMEOUT_MS)
+    , MetricsIntervalMs(METRICS_EXPORT_INTERVAL_MS)
+    , GitSsh(GIT_SSH_PATH)
+    , Origins(sizeof(SETTINGS) / sizeof(SETTINGS[0]), "default")
+{
+    const char* path = std::getenv(CONFIG_FILE_VAR);
+    if (path && *path) {
+        std::ifstream file(path);
+        if (!file)
+            LOG_ERROR("Couldn't open config file " << path);
+
+        std::string line;
+        for (unsigned lineNo = 1; std::getline(file, line); ++lineNo) {
+            line = Trim(line.substr(0, line.find('#')));
+            if (line.empty())
+                continue;
+
+            const size_t eq = line.find('=');
+            const std::string name = Trim(line.substr(0, eq));
+            size_t i = 0;
+            while (i < Origins.size() && name != SETTINGS[i].Name)
+                ++i;
+            if (eq == std::string::npos || i == Origins.size()) {
+                LOG_ERROR(path << ":" << lineNo << ": unknown setting " << name);
+                continue;
+            }
+            if (Assign(*this, SETTINGS[i], Trim(line.substr(eq + 1))))
+                Origins[i] = path;
+        }
+    }
+
+    // the environment overrides the file
+    for (size_t i = 0; i < Origins.size(); ++i) {
+        std::string var = CONFIG_ENV_PREFIX;
+        for (const char* c = SETTINGS[i].Name; *c; ++c)
+            var += char(std::toupper(static_cast<unsigned char>(*c)));
+
+        const char* value = std::getenv(var.c_str());
+        if (value && *value && Assign(*this, SETTINGS[i], Trim(value)))
+            Origins[i] = var;
+    }
+
+    if (Workers <= PageantChannels) {
+        LOG_ERROR("Setting workers = " << Workers << " is raised to " << PageantChannels + 1
+                  << ", more than pageant_channels, so queries hung in Pageant leave a worker for the rest");
+        Workers = PageantChannels + 1;
+        for (size_t i = 0; i < Origins.size(); ++i) {
+            if (SETTINGS[i].Number == &Config::Workers)
+                Origins[i] += ", raised above pageant_channels";
+        }
+    }
+}
+
+const Config& Config::Get()
+{
+    static const Config instance;
+    return instance;
+}
+
+void Config::Print(std::ostream& os) const
+{
+    for (size_t i = 0; i < Origins.size(); ++i) {
+        const Setting& setting = SETTINGS[i];
+        os << setting.Name << " = ";
+        if (setting.Text) {
+            os << this->*setting.Text;
+        } else {
+            os << this->*setting.Number;
+        }
+        os << "  # " << Origins[i] << '\n';
+    }
+}
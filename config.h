@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// compiled-in defaults of the settings below
+#define BUFF_SIZE 16384      // 16Kb should be enough for everyone
+#define NETWORK_WORKERS 6    // threads serving ready connections, regardless of their number; more than Pageant channels
+#define BUFF_POOL_CONNECTIONS 16  // connections served without allocating buffers
+#define NETWORK_DRAIN_MS 200      // how long requests in flight are waited for on shutdown
+#define NETWORK_MAX_CONNECTIONS 256  // further clients wait in the listen backlog
+#define NETWORK_BACKLOG 64           // clients beyond it are refused by the OS
+
+#define PAGEANT_CHANNELS 4  // requests which can be in flight to Pageant at once
+#define PAGEANT_RETRIES 4               // attempts of a query while Pageant's window is gone
+#define PAGEANT_QUERY_TIMEOUT_MS 30000  // leaves time to confirm a key use in Pageant's dialog
+
+#define SCHEDULER_CONCURRENCY 2         // one may wait for a Pageant confirmation while another goes on
+#define SCHEDULER_QUEUE_LIMIT 64        // more waiting requests are refused
+#define SCHEDULER_LISTING_DELAY_MS 100  // handicap of identity listings against sign requests
+
+#define IDENTITY_CACHE_TTL_MS 5000  // zero disables caching
+
+#define UPSTREAM_CONNECTIONS 4      // requests which can be in flight to an upstream agent at once
+#define UPSTREAM_IDLE_TIMEOUT_MS 60000  // idle connections are closed after it, but the last used one
+#define UPSTREAM_TIMEOUT_MS 30000       // of sending a request or receiving its answer, as long as Pageant's
+
+#define METRICS_EXPORT_INTERVAL_MS 10000
+
+#define CONFIG_FILE_VAR "SSH_PAGEANT_WRAP_CONFIG"
+
+
+// Tunables, read once on first use. A setting is taken from
+// the environment variable SSH_PAGEANT_WRAP_<NAME> if it's set, otherwise from a
+// `<name> = <value>` line of the file named by SSH_PAGEANT_WRAP_CONFIG, otherwise it keeps
+// the default above. Invalid values are reported and ignored. Components copy what they
+// need when they're constructed, so nothing is looked up per request.
+// A query hung in Pageant (e.g. in its key confirmation dialog) holds a network worker
+// until it times out, so there are always more workers than Pageant channels: otherwise
+// hung queries would stall handshakes, cached answers and every other connection too.
+class Config {
+public:
+    Config(const Config&) = delete;
+    Config& operator =(const Config&) = delete;
+
+    static const Config& Get();
+
+    // effective values in the file format, with their sources as comments
+    void Print(std::ostream& os) const;
+
+public:
+    // network
+    size_t BufferSize;          // per connection and direction
+    size_t Workers;
+    size_t PooledConnections;
+    size_t MaxConnections;
+    size_t Backlog;
+    size_t DrainMs;
+
+    // Pageant
+    size_t PageantChannels;
+    size_t PageantChannelSize;  // of the file mapping, limits messages Pageant gets
+    size_t PageantRetries;
+    size_t PageantTimeoutMs;
+
+    // request handling
+    size_t SchedulerConcurrency;
+    size_t SchedulerQueueLimit;
+    size_t ListingDelayMs;
+    size_t IdentityTtlMs;
+    size_t UpstreamConnections;
+    size_t UpstreamIdleMs;
+    size_t UpstreamTimeoutMs;
+    size_t MetricsIntervalMs;
+
+    std::string GitSsh;  // the real ssh executable
+
+private:
+    Config();
+
+    std::vector<std::string> Origins;  // of every setting, in the order of the table
+};
@@ -0,0 +1,60 @@
+#include "forwarder.h"
+#include "agent_proto.h"
+
+#include <cstring>
+#include <new>
+
+// kept at the start of every block, the area follows it
+struct Forwarder::Slot {
+    Context Upstream;
+    bool Forwarded = false;
+};
+
+#define FORWARDER_SLOT_LEN ((sizeof(Forwarder::Slot) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+
+
+Forwarder::Forwarder(Network::Handler& upstream, const char* name, size_t preallocAreas)
+    : Upstream(upstream)
+    , Areas(FORWARDER_SLOT_LEN + SA_MAX_MESSAGE_LEN, preallocAreas, name)
+{ }
+
+void Forwarder::Begin(Context& ctx)
+{
+    char* block = Areas.Acquire();
+    Slot* slot = new (block) Slot();
+    slot->Upstream.Conn = ctx.Conn;
+    ctx.Area = block + FORWARDER_SLOT_LEN;
+    ctx.Capacity = SA_MAX_MESSAGE_LEN;
+    ctx.Token = slot;
+}
+
+Buffer Forwarder::Forward(Context& ctx, size_t len)
+{
+    Slot& slot = *static_cast<Slot*>(const_cast<void*>(ctx.Token));
+    if (!slot.Forwarded) {
+        Upstream.Begin(slot.Upstream);
+        slot.Forwarded = true;
+    }
+    if (len > slot.Upstream.Capacity)
+        THROW_RUNTIME_ERROR("request of " << len << " bytes doesn't fit to the upstream area of "
+                            << slot.Upstream.Capacity);
+
+    std::memcpy(slot.Upstream.Area, ctx.Area, len);
+    return Upstream.Query(slot.Upstream, len);
+}
+
+bool Forwarder::IsForwarded(const Context& ctx) const
+{
+    return static_cast<const Slot*>(ctx.Token)->Forwarded;
+}
+
+bool Forwarder::End(Context& ctx) noexcept
+{
+    Slot* slot = static_cast<Slot*>(const_cast<void*>(ctx.Token));
+    const bool forwarded = slot->Forwarded;
+    if (forwarded)
+        Upstream.End(slot->Upstream);
+    slot->~Slot();
+    Areas.Release(reinterpret_cast<char*>(slot));
+    return forwarded;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "common.h"
+#include "buffer_pool.h"
+#include "config.h"
+#include "network.h"
+#include <cstddef>
+
+
+// Receives requests into local areas and hands them to the upstream handler only
+// when asked to: the upstream Begin() (e.g. checkout of a Pageant channel) is put off
+// until Forward() and matched in End(). For handlers in front of the backend which
+// answer some requests themselves or make them wait before they may hold a channel.
+class Forwarder {
+public:
+    Forwarder(const Forwarder&) = delete;
+    Forwarder& operator =(const Forwarder&) = delete;
+
+    using Context = Network::Handler::Context;
+
+public:
+    Forwarder(Network::Handler& upstream, const char* name, size_t preallocAreas = Config::Get().Workers);
+
+    void Begin(Context& ctx);                 // a local area, ctx.Token is taken
+    Buffer Forward(Context& ctx, size_t len);  // copies the request upstream and queries it there
+    bool End(Context& ctx) noexcept;           // true if the request has been forwarded
+
+    bool IsForwarded(const Context& ctx) const;
+    BufferPool::Stats GetStats() const { return Areas.GetStats(); }
+
+private:
+    struct Slot;
+
+    Network::Handler& Upstream;
+    BufferPool Areas;  // of a Slot followed by the request area, named for the metrics
+};
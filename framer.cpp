@@ -0,0 +1,91 @@
+#include "framer.h"
+#include "agent_proto.h"
+
+#include <cassert>
+#include <cstring>
+
+
+void Framer::Attach(char* in, char* out, size_t capacity)
+{
+    In = OwnIn = in;
+    Out = OwnOut = out;
+    InCapacity = OutCapacity = Capacity = capacity;
+    InLen = OutLen = OutSent = 0;
+    BigIn.reset();
+    BigOut.reset();
+}
+
+void Framer::Received(size_t len)
+{
+    assert(len <= GetSpaceLen());
+    InLen += len;
+}
+
+size_t Framer::PeekMessage()
+{
+    if (InLen < SA_HEADER_LEN)
+        return 0;
+
+    const size_t len = SA_HEADER_LEN + SaMessageLen(In);
+    if (len > SA_MAX_MESSAGE_LEN)
+        THROW_RUNTIME_ERROR("sizeof of SA message is too big: " << len);
+
+    if (len > InCapacity) {
+        std::unique_ptr<char[]> big(new char[len]);
+        std::memcpy(big.get(), In, InLen);
+        BigIn = std::move(big);
+        In = BigIn.get();
+        InCapacity = len;
+    }
+    return PeekFixed(len);
+}
+
+void Framer::Consume(size_t len)
+{
+    assert(len <= InLen);
+    InLen -= len;
+    if (BigIn && InLen <= Capacity) {
+        std::memcpy(OwnIn, In + len, InLen);
+        In = OwnIn;
+        InCapacity = Capacity;
+        BigIn.reset();
+    } else if (InLen) {
+        std::memmove(In, In + len, InLen);
+    }
+}
+
+void Framer::Queue(const void* data, size_t len)
+{
+    if (len > OutCapacity - OutLen) {
+        const size_t pending = OutLen - OutSent;
+        const size_t capacity = pending + len;
+        if (capacity > 2 * SA_MAX_MESSAGE_LEN)
+            THROW_RUNTIME_ERROR("output doesn't fit " << len << " bytes more");
+
+        // the sent part is dropped on the way
+        std::unique_ptr<char[]> big(new char[capacity]);
+        std::memcpy(big.get(), Out + OutSent, pending);
+        BigOut = std::move(big);
+        Out = BigOut.get();
+        OutLen = pending;
+        OutSent = 0;
+        OutCapacity = capacity;
+    }
+
+    std::memcpy(Out + OutLen, data, len);
+    OutLen += len;
+}
+
+void Framer::Sent(size_t len)
+{
+    assert(len <= OutLen - OutSent);
+    OutSent += len;
+    if (OutSent == OutLen) {
+        OutLen = OutSent = 0;
+        if (BigOut) {
+            Out = OwnOut;
+            OutCapacity = Capacity;
+            BigOut.reset();
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <memory>
+
+
+// Incremental framing of an ssh-agent connection's byte stream, free of any I/O:
+// whatever is received is appended to the input, complete messages are taken from
+// its head, and responses are queued to the output until the socket accepts them.
+// Both buffers are owned by the caller and have the same capacity. A message or
+// output which doesn't fit is moved to a heap buffer up to SA_MAX_MESSAGE_LEN and
+// goes back to the caller's buffer once it's consumed or sent.
+class Framer {
+public:
+    void Attach(char* in, char* out, size_t capacity);
+    size_t GetCapacity() const { return Capacity; }  // of the caller's buffers
+
+    // free space at the end of the input, Received() tells how much of it was filled
+    char* GetSpace() const { return In + InLen; }
+    size_t GetSpaceLen() const { return InCapacity - InLen; }
+    void Received(size_t len);
+
+    const char* GetInput() const { return In; }
+    size_t GetInputLen() const { return InLen; }
+
+    // length of the complete frame at the head of the input, zero if it's incomplete
+    size_t PeekFixed(size_t len) const { return InLen >= len ? len : 0; }
+    size_t PeekMessage();  // ssh-agent message with its header, throws if it's too big
+    void Consume(size_t len);
+
+    size_t GetOutputLen() const { return OutLen; }  // including the part already sent
+    bool HasOutput() const { return OutSent < OutLen; }
+    void Queue(const void* data, size_t len);
+
+    Buffer GetUnsent() const { return Buffer(Out + OutSent, OutLen - OutSent); }
+    void Sent(size_t len);  // the output is reset once everything is sent
+
+private:
+    char* In = nullptr;
+    size_t InLen = 0;
+    size_t InCapacity = 0;
+    char* Out = nullptr;
+    size_t OutLen = 0;
+    size_t OutSent = 0;
+    size_t OutCapacity = 0;
+
+    char* OwnIn = nullptr;   // caller's buffers
+    char* OwnOut = nullptr;
+    size_t Capacity = 0;
+    std::unique_ptr<char[]> BigIn;
+    std::unique_ptr<char[]> BigOut;
+};
@@ -0,0 +1,124 @@
+#include "identity_cache.h"
+#include "agent_proto.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <cstring>
+
+
+IdentityCache::IdentityCache(Network::Handler& upstream, std::chrono::milliseconds ttl)
+    : Local(upstream, "identity_cache")
+    , Ttl(ttl)
+{
+    // hits against misses tell whether the TTL suits how often ssh lists identities
+    Metrics::AddSource(this, [this](std::ostream& os) {
+        const Stats stats = GetStats();
+        os << "identity_cache hits " << stats.Hits << " misses " << stats.Misses << " coalesced "
+           << stats.Coalesced << " invalidations " << stats.Invalidations << '\n';
+    });
+}
+
+IdentityCache::~IdentityCache()
+{
+    Metrics::RemoveSource(this);
+}
+
+IdentityCache::Stats IdentityCache::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    return Counters;
+}
+
+void IdentityCache::Invalidate()
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    Answer.clear();
+    ++Generation;
+    ++Counters.Invalidations;
+}
+
+Buffer IdentityCache::Query(Context& ctx, size_t len)
+{
+    const uint8_t type = SaMessageType(ctx.Area, len);
+    if (type == SSH2_AGENTC_REQUEST_IDENTITIES && len == SA_HEADER_LEN + 1 && Ttl.count() > 0)
+        return QueryIdentities(ctx, len);
+
+    if (!SaChangesIdentities(type))
+        return Local.Forward(ctx, len);
+
+    // invalidate on both sides, so a listing fetched while the change
+    // is in progress isn't cached
+    Invalidate();
+    try {
+        const Buffer resp = Local.Forward(ctx, len);
+        Invalidate();
+        TRACE(CacheInvalidated, 0, type, 0);
+        return resp;
+    } catch (...) {
+        Invalidate();
+        throw;
+    }
+}
+
+bool IdentityCache::TryAnswer(Context& ctx)
+{
+    if (Answer.empty())
+        return false;
+
+    if (Clock::now() >= Expires) {
+        Answer.clear();
+        return false;
+    }
+
+    if (Answer.size() > ctx.Capacity)
+        return false;
+
+    std::memcpy(ctx.Area, Answer.data(), Answer.size());
+    return true;
+}
+
+Buffer IdentityCache::QueryIdentities(Context& ctx, size_t len)
+{
+    std::unique_lock<std::mutex> lock(Mtx);
+    if (TryAnswer(ctx)) {
+        ++Counters.Hits;
+        TRACE(CacheHit, 0, 0, 0);
+        return Buffer(ctx.Area, Answer.size());
+    }
+
+    if (Fetching) {
+        ++Counters.Coalesced;
+        do {
+            Cv.wait(lock);
+            if (TryAnswer(ctx))
+                return Buffer(ctx.Area, Answer.size());
+        } while (Fetching);
+        // the query failed or its answer was invalidated, make our own one
+    }
+
+    ++Counters.Misses;
+    TRACE(CacheMiss, 0, 0, 0);
+    Fetching = true;
+    const uint64_t generation = Generation;
+    lock.unlock();
+
+    try {
+        const Buffer resp = Local.Forward(ctx, len);
+
+        lock.lock();
+        Fetching = false;
+        if (generation == Generation && SaMessageType(resp.ptr, resp.len) == SSH2_AGENT_IDENTITIES_ANSWER) {
+            const char* data = static_cast<const char*>(resp.ptr);
+            Answer.assign(data, data + resp.len);
+            Expires = Clock::now() + Ttl;
+        }
+        Cv.notify_all();
+        return resp;
+    } catch (...) {
+        if (!lock.owns_lock())
+            lock.lock();
+        Fetching = false;
+        Cv.notify_all();
+        throw;
+    }
+}
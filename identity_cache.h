@@ -0,0 +1,59 @@
+#pragma once
+#include "common.h"
+#include "config.h"
+#include "forwarder.h"
+#include "network.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+
+// Answers SSH2_AGENTC_REQUEST_IDENTITIES from memory. Concurrent requests are
+// coalesced into one upstream query; the answer expires after TTL or as soon as
+// a message changing the agent's identities (add, remove, lock...) passes through.
+// Requests are received into local areas, so answers from memory don't check out
+// a Pageant channel or an agent connection; only the others are forwarded upstream.
+class IdentityCache : public Network::Handler {
+public:
+    IdentityCache(const IdentityCache&) = delete;
+    IdentityCache& operator =(const IdentityCache&) = delete;
+
+    struct Stats {
+        uint64_t Hits = 0;
+        uint64_t Misses = 0;
+        uint64_t Coalesced = 0;  // waited for a query issued by another request
+        uint64_t Invalidations = 0;
+    };
+
+public:
+    explicit IdentityCache(Network::Handler& upstream,
+                           std::chrono::milliseconds ttl = std::chrono::milliseconds(Config::Get().IdentityTtlMs));
+    ~IdentityCache();
+
+    void Begin(Context& ctx) override { Local.Begin(ctx); }
+    Buffer Query(Context& ctx, size_t len) override;
+    void End(Context& ctx) noexcept override { Local.End(ctx); }
+
+    void Invalidate();
+    Stats GetStats() const;
+
+private:
+    Buffer QueryIdentities(Context& ctx, size_t len);
+    bool TryAnswer(Context& ctx);  // must be called with Mtx held
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    Forwarder Local;
+    const std::chrono::milliseconds Ttl;
+
+    mutable std::mutex Mtx;
+    std::condition_variable Cv;
+    std::vector<char> Answer;    // empty if nothing cached
+    Clock::time_point Expires;
+    uint64_t Generation = 0;     // bumped on every invalidation
+    bool Fetching = false;       // an upstream query is in flight
+    Stats Counters;
+};
@@ -0,0 +1,549 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "agent_proto.h"
+#include "backend.h"
+#include "identity_cache.h"
+#include "metrics.h"
+#include "network.h"
+#include "poller.h"
+#include "scheduler.h"
+#include "common.h"
+
+#ifdef _WIN32
+    #include <Windows.h>
+    #include <afunix.h>
+    #define SEND_FLAGS 0
+#else
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+    #define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#define LOAD_CLIENTS 32       // running at once, like `git submodule update --jobs=32`
+#define LOAD_SESSIONS 10      // per client, each is a new connection like a new ssh process
+#define LOAD_REQUESTS 2       // per session, ssh lists identities and signs once
+#define LOAD_SIGN_PERCENT 50  // of requests
+#define LOAD_DATA_LEN 256     // bytes to sign, ssh's session hash is about 100
+#define LOAD_PIPELINE_BYTES 65536  // of requests sent ahead, below socket buffers so batches can't deadlock
+#define STARTUP_RUNS 10            // launches of the wrapper, the median is reported
+
+// Simulates many ssh clients: every client opens connections one after another,
+// does the Cygwin handshake if needed and sends a mix of identity and sign requests.
+// Without a target the wrapper's handler chain is served in-process by a backend.
+// With pipelining requests are sent in batches before their responses are read, and
+// the load is run without it first, so both results can be compared.
+const char* const USAGE =
+    "usage: ssh-pageant-wrap-load [-c <clients>] [-k <sessions per client>] [-n <requests per session>]\n"
+    "                             [-s <sign percent>] [-d <data bytes>] [-p <pipeline depth>]\n"
+    "                             [-b <backend spec> | -t <target>]\n"
+    "target: Cygwin socket file (with the port and secret) or native unix socket of a running wrapper\n"
+    "       ssh-pageant-wrap-load --startup <wrapper executable> [<runs>]  (Windows)";
+
+// The wrapper is launched with this program as its ssh, which lists identities once
+// through the agent socket it's given, so both startup milestones the wrapper dumps
+// with its metrics are reached: ssh launched and the first agent reply.
+const char* const STARTUP_OPTION = "--startup";
+const char* const STARTUP_CLIENT_OPTION = "--startup-client";
+
+namespace {
+
+struct Options {
+    unsigned Clients = LOAD_CLIENTS;
+    unsigned Sessions = LOAD_SESSIONS;
+    unsigned Requests = LOAD_REQUESTS;
+    unsigned SignPercent = LOAD_SIGN_PERCENT;
+    size_t DataLen = LOAD_DATA_LEN;
+    unsigned Pipeline = 1;  // requests sent before reading responses
+    std::string Backend = "stub";
+    std::string Target;
+};
+
+bool ParseOptions(int argc, char* argv[], Options& opts) {
+    for (int i = 1; i < argc; i += 2) {
+        const std::string opt = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        const char* value = argv[i + 1];
+        const unsigned number = unsigned(std::strtoul(value, nullptr, 10));
+
+        if (opt == "-c") {
+            opts.Clients = number;
+        } else if (opt == "-k") {
+            opts.Sessions = number;
+        } else if (opt == "-n") {
+            opts.Requests = number;
+        } else if (opt == "-s") {
+            opts.SignPercent = number;
+        } else if (opt == "-d") {
+            opts.DataLen = number;
+        } else if (opt == "-p") {
+            opts.Pipeline = number;
+        } else if (opt == "-b") {
+            opts.Backend = value;
+        } else if (opt == "-t") {
+            opts.Target = value;
+        } else {
+            return false;
+        }
+    }
+    return opts.Clients > 0 && opts.SignPercent <= 100 && opts.DataLen <= SA_MAX_MESSAGE_LEN / 2
+            && opts.Pipeline > 0 && opts.Pipeline * (opts.DataLen + SA_HEADER_LEN + 128) <= LOAD_PIPELINE_BYTES;
+}
+
+
+// where clients connect to
+struct Target {
+    uint16_t Port = 0;  // Cygwin's emulated socket, the handshake goes first
+    char Secret[CYGWIN_SECRET_LEN] = {};
+    std::string Path;   // native unix socket otherwise
+};
+
+Target ResolveTarget(const std::string& spec) {
+    Target target;
+    char content[128] = {0};
+    if (std::FILE* f = std::fopen(spec.c_str(), "rb")) {
+        std::fread(content, 1, sizeof(content) - 1, f);
+        std::fclose(f);
+    }
+
+    unsigned port = 0;
+    uint32_t secret[CYGWIN_SECRET_LEN / 4] = {};
+    if (std::sscanf(content, "!<socket >%u s %8X-%8X-%8X-%8X", &port,
+                    &secret[0], &secret[1], &secret[2], &secret[3]) == 5) {
+        target.Port = uint16_t(port);
+        std::memcpy(target.Secret, secret, sizeof(secret));
+    } else {
+        target.Path = spec;
+    }
+    return target;
+}
+
+
+void SendAll(SocketHandle sock, const char* data, size_t len) {
+    while (len) {
+        const int rc = send(sock, data, int(len), SEND_FLAGS);
+        if (rc == SOCKET_ERROR)
+            THROW_RUNTIME_ERROR("socket send failed: " << LastSocketError());
+        data += rc;
+        len -= rc;
+    }
+}
+
+void RecvAll(SocketHandle sock, char* data, size_t len) {
+    while (len) {
+        const int rc = recv(sock, data, int(len), 0);
+        if (rc == 0)
+            THROW_RUNTIME_ERROR("connection closed by the server");
+        if (rc == SOCKET_ERROR)
+            THROW_RUNTIME_ERROR("socket recv failed: " << LastSocketError());
+        data += rc;
+        len -= rc;
+    }
+}
+
+// a connected client socket, with the handshake done
+class Connection {
+public:
+    Connection(const Connection&) = delete;
+    Connection& operator =(const Connection&) = delete;
+
+public:
+    explicit Connection(const Target& target);
+    ~Connection() { CloseSocket(Sock); }
+
+    void Send(const std::vector<char>& reqs) { SendAll(Sock, reqs.data(), reqs.size()); }
+    // returns the next response's length, it's left in `resp`
+    size_t Receive(std::vector<char>& resp);
+
+private:
+    void Echo(const char* data, size_t len);
+
+private:
+    SocketHandle Sock = INVALID_SOCKET;
+};
+
+Connection::Connection(const Target& target)
+{
+    sockaddr_storage storage = {};
+    SockLen len = 0;
+    if (target.Port) {
+        sockaddr_in& addr = reinterpret_cast<sockaddr_in&>(storage);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(target.Port);
+        len = sizeof(addr);
+    } else {
+        sockaddr_un& addr = reinterpret_cast<sockaddr_un&>(storage);
+        if (target.Path.size() >= sizeof(addr.sun_path))
+            THROW_RUNTIME_ERROR("unix socket path is too long: " << target.Path);
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, target.Path.c_str(), target.Path.size());
+        len = sizeof(addr);
+    }
+
+    Sock = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (Sock == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("socket failed: " << LastSocketError());
+
+    if (connect(Sock, (const sockaddr*)&storage, len) == SOCKET_ERROR) {
+        const int err = LastSocketError();
+        CloseSocket(Sock);
+        THROW_RUNTIME_ERROR("couldn't connect: " << err);
+    }
+
+    if (target.Port) {
+        try {
+            const uint32_t cred[CYGWIN_CRED_LEN / 4] = { 1000, 1000, 1000 };  // pid, uid, gid
+            Echo(target.Secret, CYGWIN_SECRET_LEN);
+            Echo(reinterpret_cast<const char*>(cred), CYGWIN_CRED_LEN);
+        } catch (...) {
+            CloseSocket(Sock);
+            throw;
+        }
+    }
+}
+
+void Connection::Echo(const char* data, size_t len)
+{
+    char echo[CYGWIN_SECRET_LEN];
+    SendAll(Sock, data, len);
+    RecvAll(Sock, echo, len);
+    if (std::memcmp(data, echo, len) != 0)
+        THROW_RUNTIME_ERROR("handshake isn't echoed back");
+}
+
+size_t Connection::Receive(std::vector<char>& resp)
+{
+    RecvAll(Sock, resp.data(), SA_HEADER_LEN);
+    const size_t len = SA_HEADER_LEN + SaMessageLen(resp.data());
+    if (len > resp.size())
+        THROW_RUNTIME_ERROR("response message is too big: " << len);
+    RecvAll(Sock, resp.data() + SA_HEADER_LEN, len - SA_HEADER_LEN);
+    return len;
+}
+
+
+void PutUint32(std::vector<char>& msg, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        msg.push_back(char(value >> shift));
+}
+
+void PutString(std::vector<char>& msg, const std::string& value) {
+    PutUint32(msg, uint32_t(value.size()));
+    msg.insert(msg.end(), value.begin(), value.end());
+}
+
+std::vector<char> MakeRequest(uint8_t type, const std::string& key, size_t dataLen) {
+    std::vector<char> msg;
+    PutUint32(msg, 0);
+    msg.push_back(char(type));
+    if (type == SSH2_AGENTC_SIGN_REQUEST) {
+        PutString(msg, key);
+        PutString(msg, std::string(dataLen, 'x'));
+        PutUint32(msg, 0);  // flags
+    }
+
+    const uint32_t len = htonl(uint32_t(msg.size() - SA_HEADER_LEN));
+    std::memcpy(msg.data(), &len, sizeof(len));
+    return msg;
+}
+
+// the first key of an identities answer, to sign with it further
+std::string FirstKey(const std::vector<char>& resp, size_t len) {
+    const size_t keyOffset = SA_HEADER_LEN + 1 + 4 + 4;
+    if (len < keyOffset || SaMessageLen(resp.data() + SA_HEADER_LEN + 1) == 0)
+        return std::string();
+
+    const size_t keyLen = SaMessageLen(resp.data() + keyOffset - 4);
+    if (keyLen > len - keyOffset)
+        return std::string();
+    return std::string(resp.data() + keyOffset, keyLen);
+}
+
+
+struct Results {
+    LatencyHistogram Connect;  // including the handshake
+    LatencyHistogram Identities;
+    LatencyHistogram Sign;
+    std::atomic<uint64_t> Refused;   // requests the agent answered with failure
+    std::atomic<uint64_t> Failures;  // sessions broken by an error
+
+    Results() : Refused(0), Failures(0) { }
+};
+
+void RunClient(const Target& target, const Options& opts, unsigned seed, Results& results) {
+    std::minstd_rand rng(seed + 1);
+    std::vector<char> resp(SA_MAX_MESSAGE_LEN);
+    std::string key = "load-generator-key";  // until some agent's key is listed
+
+    for (unsigned s = 0; s < opts.Sessions; ++s) {
+        try {
+            const uint64_t start = Metrics::Now();
+            Connection conn(target);
+            results.Connect.Record(Metrics::Now() - start);
+
+            for (unsigned r = 0; r < opts.Requests; ) {
+                // a batch goes with one send, its latencies are counted from there
+                const unsigned count = std::min(opts.Pipeline, opts.Requests - r);
+                std::vector<bool> signs;
+                std::vector<char> batch;
+                for (unsigned i = 0; i < count; ++i) {
+                    signs.push_back(rng() % 100 < opts.SignPercent);
+                    const std::vector<char> req = signs.back()
+                            ? MakeRequest(SSH2_AGENTC_SIGN_REQUEST, key, opts.DataLen)
+                            : MakeRequest(SSH2_AGENTC_REQUEST_IDENTITIES, key, 0);
+                    batch.insert(batch.end(), req.begin(), req.end());
+                }
+
+                const uint64_t sent = Metrics::Now();
+                conn.Send(batch);
+                for (const bool sign : signs) {
+                    const size_t len = conn.Receive(resp);
+                    const uint64_t elapsed = Metrics::Now() - sent;
+
+                    const uint8_t type = SaMessageType(resp.data(), len);
+                    if (type == SSH_AGENT_FAILURE)
+                        ++results.Refused;
+                    if (sign) {
+                        results.Sign.Record(elapsed);
+                    } else {
+                        results.Identities.Record(elapsed);
+                        const std::string listed = type == SSH2_AGENT_IDENTITIES_ANSWER ? FirstKey(resp, len) : std::string();
+                        if (!listed.empty())
+                            key = listed;
+                    }
+                }
+                r += count;
+            }
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Session failed: " << exc.what());
+            ++results.Failures;
+        }
+    }
+}
+
+void Report(const char* name, const LatencyHistogram& h) {
+    std::cout << std::fixed << std::setprecision(1) << name << " latency us: count " << h.GetCount()
+              << " mean " << h.GetMean() / 1000.0 << " p50 " << h.GetPercentile(50) / 1000.0
+              << " p99 " << h.GetPercentile(99) / 1000.0 << " p999 " << h.GetPercentile(99.9) / 1000.0
+              << " max " << h.GetMax() / 1000.0 << '\n';
+}
+
+int RunLoad(const Target& target, Options opts) {
+    if (opts.Pipeline > 1) {
+        Options plain = opts;  // the baseline to compare with
+        plain.Pipeline = 1;
+        const int code = RunLoad(target, plain);
+        if (code)
+            return code;
+    }
+
+    Results results;
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < opts.Clients; ++i)
+        threads.emplace_back(RunClient, std::cref(target), std::cref(opts), i, std::ref(results));
+    for (std::thread& thread : threads)
+        thread.join();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const uint64_t requests = results.Identities.GetCount() + results.Sign.GetCount();
+    std::cout << opts.Clients << " clients, pipeline depth " << opts.Pipeline << ", "
+              << results.Connect.GetCount() << " sessions, " << requests
+              << " requests (" << results.Refused << " refused), " << results.Failures << " sessions failed in "
+              << std::fixed << std::setprecision(3) << seconds << " s: " << std::setprecision(1)
+              << (seconds > 0 ? requests / seconds : 0) << " requests/s, "
+              << (seconds > 0 ? results.Connect.GetCount() / seconds : 0) << " sessions/s\n";
+    Report("connect", results.Connect);
+    Report("identities", results.Identities);
+    Report("sign", results.Sign);
+    return results.Failures ? 1 : 0;
+}
+
+
+#ifdef _WIN32
+
+void StartSockets() {
+    WSADATA wsaData = {0};
+    if (int err = WSAStartup(MAKEWORD(2, 2), &wsaData))
+        THROW_RUNTIME_ERROR("WSAStartup failed: " << err);
+}
+
+// run by the wrapper in place of ssh
+int RunStartupClient() {
+    const char* sock = std::getenv("SSH_AUTH_SOCK");
+    if (!sock || !*sock)
+        THROW_RUNTIME_ERROR("SSH_AUTH_SOCK isn't set");
+
+    std::string path = sock;
+    const char* temp = std::getenv("TEMP");
+    if (temp && path.compare(0, 5, "/tmp/") == 0)
+        path = temp + path.substr(4);  // Cygwin's view of %TEMP%
+
+    StartSockets();
+    Connection conn(ResolveTarget(path));
+    std::vector<char> resp(SA_MAX_MESSAGE_LEN);
+    conn.Send(MakeRequest(SSH2_AGENTC_REQUEST_IDENTITIES, std::string(), 0));
+    conn.Receive(resp);
+    return 0;
+}
+
+// milestones of a wrapper run in microseconds since its start, zero if not reached
+struct StartupTimes {
+    double SshLaunched = 0;
+    double FirstReply = 0;
+    double Exited = 0;  // as seen by the launcher
+};
+
+StartupTimes ReadStartupTimes(const std::string& metricsPath) {
+    StartupTimes times;
+    std::ifstream file(metricsPath.c_str());
+    std::string line;
+    while (std::getline(file, line)) {
+        char stage[64] = {0};
+        double us = 0;
+        if (std::sscanf(line.c_str(), "startup %63s %lf", stage, &us) != 2)
+            continue;
+        if (std::strcmp(stage, "ssh_launched_us") == 0)
+            times.SshLaunched = us;
+        else if (std::strcmp(stage, "first_reply_us") == 0)
+            times.FirstReply = us;
+    }
+    return times;
+}
+
+double Median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+// no broker should be running, since the wrapper would leave requests to it
+int RunStartup(const std::string& wrapper, unsigned runs) {
+    char self[MAX_PATH] = {0};
+    if (!GetModuleFileNameA(NULL, self, sizeof(self)))
+        THROW_RUNTIME_ERROR("GetModuleFileName failed: " << GetLastError());
+
+    const char* temp = std::getenv("TEMP");
+    const std::string metricsPath = std::string(temp ? temp : ".") + "\\ssh-pageant-wrap-startup."
+                                    + std::to_string(GetCurrentProcessId());
+    if (!SetEnvironmentVariableA("SSH_PAGEANT_WRAP_GIT_SSH", self)
+            || !SetEnvironmentVariableA("SSH_PAGEANT_WRAP_METRICS", metricsPath.c_str()))
+        THROW_RUNTIME_ERROR("Couldn't set environment: " << GetLastError());
+
+    const std::string commandLine = "\"" + wrapper + "\" " + STARTUP_CLIENT_OPTION;
+    std::vector<StartupTimes> results;
+    for (unsigned run = 0; run < runs; ++run) {
+        std::remove(metricsPath.c_str());
+        std::vector<char> cmd(commandLine.begin(), commandLine.end());
+        cmd.push_back('\0');
+
+        STARTUPINFOA si = {};
+        si.cb = sizeof(si);
+        PROCESS_INFORMATION pi = {};
+        const uint64_t start = Metrics::Now();
+        if (!CreateProcessA(wrapper.c_str(), cmd.data(), NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+            THROW_RUNTIME_ERROR("Couldn't start " << wrapper << ": " << GetLastError());
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        const uint64_t exited = Metrics::Now();
+
+        DWORD code = 0;
+        GetExitCodeProcess(pi.hProcess, &code);
+        CloseHandle(pi.hProcess);
+        CloseHandle(pi.hThread);
+
+        StartupTimes times = ReadStartupTimes(metricsPath);
+        times.Exited = (exited - start) / 1000.0;
+        if (code != 0 || times.SshLaunched == 0 || times.FirstReply == 0)
+            THROW_RUNTIME_ERROR("run " << run + 1 << " failed with code " << code
+                                << ", no startup milestones in " << metricsPath);
+        std::cout << std::fixed << std::setprecision(1) << "run " << run + 1 << ": ssh launched "
+                  << times.SshLaunched << " us, first agent reply " << times.FirstReply
+                  << " us, exited " << times.Exited << " us\n";
+        results.push_back(times);
+    }
+    std::remove(metricsPath.c_str());
+
+    std::vector<double> launched, replied, exited;
+    for (const StartupTimes& times : results) {
+        launched.push_back(times.SshLaunched);
+        replied.push_back(times.FirstReply);
+        exited.push_back(times.Exited);
+    }
+    std::cout << "median of " << runs << " runs: ssh launched " << Median(launched) << " us, first agent reply "
+              << Median(replied) << " us, exited " << Median(exited) << " us" << std::endl;
+    return 0;
+}
+
+#endif  // _WIN32
+
+}  // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && (std::strcmp(argv[1], STARTUP_OPTION) == 0 || std::strcmp(argv[1], STARTUP_CLIENT_OPTION) == 0)) {
+#ifdef _WIN32
+        try {
+            if (std::strcmp(argv[1], STARTUP_CLIENT_OPTION) == 0)
+                return RunStartupClient();
+            if (argc == 3 || argc == 4) {
+                const unsigned runs = argc == 4 ? unsigned(std::strtoul(argv[3], nullptr, 10)) : STARTUP_RUNS;
+                return RunStartup(argv[2], runs ? runs : 1);
+            }
+        } catch (const std::exception& exc) {
+            std::cerr << exc.what() << std::endl;
+            return -1;
+        }
+#endif
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+
+    Options opts;
+    if (!ParseOptions(argc, argv, opts)) {
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+
+    try {
+        if (!opts.Target.empty()) {
+#ifdef _WIN32
+            WSADATA wsaData = {0};
+            if (int err = WSAStartup(MAKEWORD(2, 2), &wsaData))
+                THROW_RUNTIME_ERROR("WSAStartup failed: " << err);
+#endif
+            return RunLoad(ResolveTarget(opts.Target), opts);
+        }
+
+        // the same chain the wrapper serves clients with
+        const std::unique_ptr<AgentBackend> backend = AgentBackend::Create(opts.Backend);
+        Scheduler scheduler(*backend);
+        IdentityCache identities(scheduler);
+        Network net(identities);
+
+        Target target;
+        target.Port = net.GetPort();
+        std::memcpy(target.Secret, net.GetSecret(), sizeof(target.Secret));
+        return RunLoad(target, opts);
+    } catch (const std::exception& exc) {
+        std::cerr << exc.what() << std::endl;
+    }
+    return -1;
+}
@@ -1,98 +1,282 @@
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <thread>
-#include <mutex>
 
+#include "backend.h"
+#include "capture.h"
+#include "config.h"
+#include "identity_cache.h"
+#include "metrics.h"
 #include "network.h"
-#include "pageant.h"
+#include "scheduler.h"
+#include "trace.h"
 #include "common.h"
 
 #include <Windows.h>
 #include <Winbase.h>
 
 
-const char* const ssh = GIT_SSH_PATH;
-Pageant pageant;
-std::mutex pageantMtx;
+// a long-lived broker owns the listener and Pageant channels for all invocations
+const char* const BROKER_OPTION = "--broker";
+const char* const BROKER_SOCKET_NAME = "agent.broker";
 
-int SendToAgent(char* buff, int len)
+// prints the effective settings and where each came from, see Config
+const char* const CONFIG_OPTION = "--config";
+
+// connection and request events are traced to the file given by the variable
+const char* const TRACE_FILE_VAR = "SSH_PAGEANT_WRAP_TRACE";
+
+// file the per-message metrics are dumped to periodically and on exit
+const char* const METRICS_FILE_VAR = "SSH_PAGEANT_WRAP_METRICS";
+
+// ssh clients supporting native unix sockets skip Cygwin's emulation
+const char* const NATIVE_SOCKET_VAR = "SSH_PAGEANT_WRAP_NATIVE_SOCKET";
+const char* const NATIVE_SOCKET_SUFFIX = ".sock";
+
+// where answers come from, see AgentBackend::Create(); Pageant if not set
+const char* const BACKEND_VAR = "SSH_PAGEANT_WRAP_BACKEND";
+
+// agent traffic is captured to the file for ssh-pageant-wrap-replay, with only types and
+// lengths of messages if redacted; the pid is appended to the name, as git runs a wrapper
+// per ssh at once (submodule update --jobs=N) and each needs a capture of its own
+const char* const CAPTURE_FILE_VAR = "SSH_PAGEANT_WRAP_CAPTURE";
+const char* const CAPTURE_REDACT_VAR = "SSH_PAGEANT_WRAP_CAPTURE_REDACT";
+
+// the backend is set up while the listener is started and ssh is spawned
+std::unique_ptr<AgentBackend> CreateBackend()
+{
+    const char* spec = std::getenv(BACKEND_VAR);
+    return std::unique_ptr<AgentBackend>(new DeferredBackend(spec ? spec : ""));
+}
+
+bool IsSet(const char* var)
+{
+    const char* value = std::getenv(var);
+    return value && *value && std::strcmp(value, "0") != 0;
+}
+
+// chain of handlers answering agent requests
+class Agent {
+public:
+    Agent()
+        : Backend(CreateBackend())
+        , Sched(*Backend)
+        , Identities(Sched)
+    {
+        const char* path = std::getenv(CAPTURE_FILE_VAR);
+        if (path && *path) {
+            try {
+                const std::string file = std::string(path) + "." + std::to_string(GetCurrentProcessId());
+                Capture.reset(new Recorder(Identities, file, IsSet(CAPTURE_REDACT_VAR)));
+            } catch (const std::exception& exc) {
+                LOG_ERROR(exc.what());
+            }
+        }
+    }
+
+    Network::Handler& GetHandler() {
+        if (Capture)
+            return *Capture;
+        return Identities;
+    }
+
+    void Flush() noexcept {
+        if (Capture)
+            Capture->Flush();
+    }
+
+private:
+    const std::unique_ptr<AgentBackend> Backend;
+    Scheduler Sched;
+    IdentityCache Identities;
+    std::unique_ptr<Recorder> Capture;
+};
+
+bool UseNativeSocket()
+{
+    return IsSet(NATIVE_SOCKET_VAR);
+}
+
+void SetNativeAuthSock(const std::string& path)
+{
+    if (!SetEnvironmentVariableA("SSH_AUTH_SOCK", path.c_str()))
+        LOG_ERROR("Couldn't set end variable: " << GetLastError());
+    LOG_DEBUG("Native unix socket is used: " << path);
+}
+
+// launches ssh with our command line and waits for it
+int RunSsh()
+{
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = TRUE;
+
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+
+    ZeroMemory(&si, sizeof(si));
+    ZeroMemory(&pi, sizeof(pi));
+
+    si.cb = sizeof(si);
+    si.hStdInput    = GetStdHandle(STD_INPUT_HANDLE);
+    si.hStdOutput   = GetStdHandle(STD_OUTPUT_HANDLE);
+    si.hStdError    = GetStdHandle(STD_ERROR_HANDLE);
+
+    const char* const ssh = Config::Get().GitSsh.c_str();
+    char* const commandLine = GetCommandLineA();
+
+    if (!CreateProcessA(
+        ssh,
+        commandLine,
+        &sa,
+        &sa,
+        TRUE,
+        0,
+        NULL,
+        NULL,
+        &si,
+        &pi
+    )) {
+        LOG_ERROR("Couldn't create process:\n  " << ssh << ' ' << commandLine
+                  << "\nError " << GetLastError());
+        return -1;
+    }
+
+    Metrics::MarkStartup(StartupStage::SshLaunched);
+    LOG_DEBUG("Child SSH-client process has started:\n  " << ssh << ' ' << commandLine
+              << "\nPID=" << pi.dwProcessId);
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+
+    DWORD exitCode = 0;
+    if (!GetExitCodeProcess(pi.hProcess, &exitCode)) {
+        LOG_ERROR("Couldn't get exit code of child SSH-client process: " << GetLastError());
+        exitCode = -1;
+    }
+
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+
+    return exitCode;
+}
+
+
+// ends the process at once, a request stuck in the backend may still use its objects
+void Exit(Agent& agent, int code)
+{
+    agent.Flush();
+    Metrics::StopExport();
+    Trace::Stop();
+    std::cout.flush();
+    std::cerr.flush();
+    std::_Exit(code);
+}
+
+// the socket file must be removed already, so requests in flight are the last ones
+int Finish(Agent& agent, Network& net, int code)
+{
+    if (!net.Shutdown())
+        Exit(agent, code);
+    return code;
+}
+
+
+HANDLE brokerStop = NULL;
+
+BOOL WINAPI StopBroker(DWORD)
+{
+    SetEvent(brokerStop);
+    return TRUE;
+}
+
+// serves agent requests for other invocations until it's interrupted
+int RunBroker()
 {
-    Buffer msg(buff, len);
+    if (FakeSocketFile::Attach(BROKER_SOCKET_NAME)) {
+        LOG_ERROR("Broker is already running");
+        return -1;
+    }
+
+    brokerStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!brokerStop)
+        THROW_RUNTIME_ERROR("Couldn't create event: " << GetLastError());
+    SetConsoleCtrlHandler(&StopBroker, TRUE);
+
+    Agent agent;
+    Network net(agent.GetHandler(), FakeSocketFile::GetPath(std::string(BROKER_SOCKET_NAME) + NATIVE_SOCKET_SUFFIX));
     {
-        std::lock_guard<std::mutex> lock(pageantMtx);
-        pageant.Query(msg);
+        FakeSocketFile sFile(net.GetPort(), net.GetSecret(), BROKER_SOCKET_NAME);
+
+        LOG_DEBUG("Broker is running");
+        WaitForSingleObject(brokerStop, INFINITE);
+        LOG_DEBUG("Broker is stopping");
     }
-    return msg.len;
+    return Finish(agent, net, 0);
 }
 
+// tracing is stopped and flushed when it goes out of scope
+struct TraceScope {
+    TraceScope() {
+        if (const char* path = std::getenv(TRACE_FILE_VAR))
+            if (*path)
+                Trace::Start(path);
+    }
+    ~TraceScope() { Trace::Stop(); }
+};
+
+struct MetricsScope {
+    MetricsScope() {
+        if (const char* path = std::getenv(METRICS_FILE_VAR))
+            if (*path)
+                Metrics::StartExport(path);
+    }
+    ~MetricsScope() { Metrics::StopExport(); }
+};
+
 int main(int argc, char* argv[])
 {
     try {
-        {
-            Network net(&SendToAgent);
-            FakeSocketFile sFile(net.GetPort());
-
-            // below we just launch ssh
-
-            SECURITY_ATTRIBUTES sa;
-            sa.nLength = sizeof(sa);
-            sa.lpSecurityDescriptor = NULL;
-            sa.bInheritHandle = TRUE;
-
-            STARTUPINFOA si;
-            PROCESS_INFORMATION pi;
-
-            ZeroMemory(&si, sizeof(si));
-            ZeroMemory(&pi, sizeof(pi));
-
-            si.cb = sizeof(si);
-            si.hStdInput    = GetStdHandle(STD_INPUT_HANDLE);
-            si.hStdOutput   = GetStdHandle(STD_OUTPUT_HANDLE);
-            si.hStdError    = GetStdHandle(STD_ERROR_HANDLE);
-
-            char* const commandLine = GetCommandLineA();
-
-            if (!CreateProcessA(
-                ssh,
-                commandLine,
-                &sa,
-                &sa,
-                TRUE,
-                0,
-                NULL,
-                NULL,
-                &si,
-                &pi
-            )) {
-                LOG_ERROR("Couldn't create process:\n  " << ssh << ' ' << commandLine
-                          << "\nError " << GetLastError());
-                return -1;
-            }
+        if (argc == 2 && std::strcmp(argv[1], CONFIG_OPTION) == 0) {
+            Config::Get().Print(std::cout);
+            return 0;
+        }
 
-            LOG_DEBUG("Child SSH-client process has started:\n  " << ssh << ' ' << commandLine
-                      << "\nPID=" << pi.dwProcessId);
+        TraceScope trace;
+        MetricsScope metrics;
 
-            WaitForSingleObject(pi.hProcess, INFINITE);
+        if (argc == 2 && std::strcmp(argv[1], BROKER_OPTION) == 0)
+            return RunBroker();
 
-            DWORD exitCode = 0;
-            if (!GetExitCodeProcess(pi.hProcess, &exitCode)) {
-                LOG_ERROR("Couldn't get exit code of child SSH-client process: " << GetLastError());
-                exitCode = -1;
-            }
+        const bool native = UseNativeSocket();
+        if (FakeSocketFile::Attach(BROKER_SOCKET_NAME)) {
+            LOG_DEBUG("Attached to the broker");
+            const std::string nativePath = FakeSocketFile::GetPath(std::string(BROKER_SOCKET_NAME) + NATIVE_SOCKET_SUFFIX);
+            if (native && GetFileAttributesA(nativePath.c_str()) != INVALID_FILE_ATTRIBUTES)
+                SetNativeAuthSock(nativePath);
+            return RunSsh();
+        }
 
-            CloseHandle(pi.hProcess);
-            CloseHandle(pi.hThread);
+        Agent agent;
+        Network net(agent.GetHandler(), native
+                    ? FakeSocketFile::GetPath("agent." + std::to_string(GetCurrentProcessId()) + NATIVE_SOCKET_SUFFIX)
+                    : std::string());
+        int code = 0;
+        {
+            FakeSocketFile sFile(net.GetPort(), net.GetSecret());
+            if (!net.GetUnixPath().empty())
+                SetNativeAuthSock(net.GetUnixPath());
 
-            return exitCode;
+            code = RunSsh();
         }
-        return GetLastError();
+        return Finish(agent, net, code);
     } catch (const std::exception& exc) {
         std::cerr << exc.what() << std::endl;
     }
     return -1;
 }
-
-
-
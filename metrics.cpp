@@ -0,0 +1,253 @@
+#include "metrics.h"
+#include "agent_proto.h"
+#include "common.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+enum class MessageKind {
+    Identities,
+    Sign,
+    Manage,  // add, remove, lock, unlock
+    Extension,
+    Other,
+
+    Count_
+};
+
+const char* const KindNames[] = { "identities", "sign", "manage", "extension", "other" };
+const char* const PhaseNames[] = { "receive", "wait", "backend", "send", "total" };
+const char* const StageNames[] = { "ssh_launched", "first_reply" };
+
+static_assert(sizeof(KindNames) / sizeof(KindNames[0]) == size_t(MessageKind::Count_), "kind names");
+static_assert(sizeof(PhaseNames) / sizeof(PhaseNames[0]) == size_t(RequestPhase::Count_), "phase names");
+static_assert(sizeof(StageNames) / sizeof(StageNames[0]) == size_t(StartupStage::Count_), "stage names");
+
+MessageKind KindOf(uint8_t type) {
+    switch (type) {
+    case SSH2_AGENTC_REQUEST_IDENTITIES:
+        return MessageKind::Identities;
+    case SSH2_AGENTC_SIGN_REQUEST:
+        return MessageKind::Sign;
+    case SSH_AGENTC_EXTENSION:
+        return MessageKind::Extension;
+    default:
+        return SaChangesIdentities(type) ? MessageKind::Manage : MessageKind::Other;
+    }
+}
+
+struct KindMetrics {
+    std::atomic<uint64_t> Requests;
+    std::atomic<uint64_t> RequestBytes;
+    std::atomic<uint64_t> ResponseBytes;
+    LatencyHistogram Latency[size_t(RequestPhase::Count_)];
+
+    KindMetrics() : Requests(0), RequestBytes(0), ResponseBytes(0) { }
+};
+
+KindMetrics Kinds[size_t(MessageKind::Count_)];
+
+// set during static initialization, which is close enough to the process start
+const uint64_t ProcessStart = Metrics::Now();
+std::atomic<uint64_t> Startup[size_t(StartupStage::Count_)];  // since ProcessStart, zero if not reached
+
+std::mutex SourcesMtx;  // held while sources are dumped, so they can't be removed meanwhile
+std::vector<std::pair<const void*, Metrics::Source>> Sources;
+
+std::mutex ExportMtx;
+std::condition_variable ExportCv;
+bool ExportStop = false;
+std::string ExportPath;
+std::thread Exporter;
+
+void Export() {
+    std::ofstream file(ExportPath.c_str(), std::ios::out | std::ios::trunc);
+    if (!file) {
+        LOG_ERROR("Couldn't write metrics to " << ExportPath);
+        return;
+    }
+    Metrics::Dump(file);
+}
+
+void RunExporter(size_t intervalMs) {
+    std::unique_lock<std::mutex> lock(ExportMtx);
+    while (!ExportCv.wait_for(lock, std::chrono::milliseconds(intervalMs), [] { return ExportStop; }))
+        Export();
+}
+
+}  // anonymous namespace
+
+
+LatencyHistogram::LatencyHistogram()
+    : Count(0)
+    , Sum(0)
+    , Max(0)
+{
+    for (std::atomic<uint64_t>& bucket : Buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+unsigned LatencyHistogram::Index(uint64_t value)
+{
+    if (value < (1u << SUB_BITS))
+        return unsigned(value);
+
+    const unsigned exp = 63 - __builtin_clzll(value);
+    const unsigned sub = unsigned(value >> (exp - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+    return ((exp - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+uint64_t LatencyHistogram::LowerBound(unsigned index)
+{
+    if (index < (1u << SUB_BITS))
+        return index;
+
+    const unsigned exp = (index >> SUB_BITS) + SUB_BITS - 1;
+    const uint64_t sub = index & ((1u << SUB_BITS) - 1);
+    return ((uint64_t(1) << SUB_BITS) + sub) << (exp - SUB_BITS);
+}
+
+void LatencyHistogram::Record(uint64_t ns)
+{
+    Buckets[Index(ns)].fetch_add(1, std::memory_order_relaxed);
+    Count.fetch_add(1, std::memory_order_relaxed);
+    Sum.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t max = Max.load(std::memory_order_relaxed);
+    while (ns > max && !Max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) { }
+}
+
+uint64_t LatencyHistogram::GetMean() const
+{
+    const uint64_t count = GetCount();
+    return count ? Sum.load(std::memory_order_relaxed) / count : 0;
+}
+
+uint64_t LatencyHistogram::GetPercentile(double pct) const
+{
+    const uint64_t count = GetCount();
+    if (!count)
+        return 0;
+
+    const uint64_t rank = uint64_t(pct / 100.0 * count + 0.5);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUCKETS; ++i) {
+        seen += Buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank && seen)
+            return i + 1 < BUCKETS ? std::min(LowerBound(i + 1) - 1, GetMax()) : GetMax();  // bucket's upper bound
+    }
+    return GetMax();
+}
+
+
+uint64_t Metrics::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Metrics::RecordRequest(uint8_t type, size_t reqLen, size_t respLen, const Phases& phases)
+{
+    KindMetrics& kind = Kinds[size_t(KindOf(type))];
+    kind.Requests.fetch_add(1, std::memory_order_relaxed);
+    kind.RequestBytes.fetch_add(reqLen, std::memory_order_relaxed);
+    kind.ResponseBytes.fetch_add(respLen, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < size_t(RequestPhase::Count_); ++i)
+        kind.Latency[i].Record(phases[i]);
+
+    if (Startup[size_t(StartupStage::FirstReply)].load(std::memory_order_relaxed) == 0)
+        MarkStartup(StartupStage::FirstReply);
+}
+
+void Metrics::MarkStartup(StartupStage stage)
+{
+    uint64_t unset = 0;
+    const uint64_t elapsed = Now() - ProcessStart;
+    Startup[size_t(stage)].compare_exchange_strong(unset, elapsed ? elapsed : 1, std::memory_order_relaxed);
+}
+
+void Metrics::Dump(std::ostream& os)
+{
+    for (size_t s = 0; s < size_t(StartupStage::Count_); ++s) {
+        const uint64_t elapsed = Startup[s].load(std::memory_order_relaxed);
+        if (elapsed)
+            os << "startup " << StageNames[s] << "_us " << std::fixed << std::setprecision(1) << elapsed / 1000.0 << '\n';
+    }
+
+    os << "# kind phase count mean_us p50_us p90_us p99_us p999_us max_us\n";
+    for (size_t k = 0; k < size_t(MessageKind::Count_); ++k) {
+        const KindMetrics& kind = Kinds[k];
+        const uint64_t requests = kind.Requests.load(std::memory_order_relaxed);
+        if (!requests)
+            continue;
+
+        os << KindNames[k] << " requests " << requests
+           << " request_bytes " << kind.RequestBytes.load(std::memory_order_relaxed)
+           << " response_bytes " << kind.ResponseBytes.load(std::memory_order_relaxed) << '\n';
+
+        for (size_t p = 0; p < size_t(RequestPhase::Count_); ++p) {
+            const LatencyHistogram& h = kind.Latency[p];
+            os << KindNames[k] << ' ' << PhaseNames[p] << ' ' << h.GetCount() << std::fixed << std::setprecision(1)
+               << ' ' << h.GetMean() / 1000.0
+               << ' ' << h.GetPercentile(50) / 1000.0
+               << ' ' << h.GetPercentile(90) / 1000.0
+               << ' ' << h.GetPercentile(99) / 1000.0
+               << ' ' << h.GetPercentile(99.9) / 1000.0
+               << ' ' << h.GetMax() / 1000.0 << '\n';
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(SourcesMtx);
+    for (const auto& source : Sources)
+        source.second(os);
+}
+
+void Metrics::AddSource(const void* owner, Source source)
+{
+    std::lock_guard<std::mutex> lock(SourcesMtx);
+    Sources.emplace_back(owner, std::move(source));
+}
+
+void Metrics::RemoveSource(const void* owner) noexcept
+{
+    std::lock_guard<std::mutex> lock(SourcesMtx);
+    Sources.erase(std::remove_if(Sources.begin(), Sources.end(),
+                                 [owner](const std::pair<const void*, Source>& s) { return s.first == owner; }),
+                  Sources.end());
+}
+
+void Metrics::StartExport(const std::string& path, size_t intervalMs)
+{
+    std::lock_guard<std::mutex> lock(ExportMtx);
+    if (Exporter.joinable())
+        return;
+
+    ExportPath = path;
+    ExportStop = false;
+    Exporter = std::thread(&RunExporter, intervalMs);
+    LOG_DEBUG("Metrics are exported to " << path);
+}
+
+void Metrics::StopExport()
+{
+    {
+        std::lock_guard<std::mutex> lock(ExportMtx);
+        if (!Exporter.joinable())
+            return;
+        ExportStop = true;
+    }
+    ExportCv.notify_all();
+    try { Exporter.join(); } catch (...) { }
+
+    Export();
+}
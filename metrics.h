@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include "config.h"
+
+
+// HDR-style histogram: 8 linear sub-buckets per power of two (~12% precision),
+// recording is a couple of relaxed atomic increments
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t ns);
+
+    uint64_t GetCount() const { return Count.load(std::memory_order_relaxed); }
+    uint64_t GetMean() const;
+    uint64_t GetMax() const { return Max.load(std::memory_order_relaxed); }
+    uint64_t GetPercentile(double pct) const;
+
+private:
+    enum { SUB_BITS = 3, BUCKETS = 64 << SUB_BITS };
+
+    static unsigned Index(uint64_t value);
+    static uint64_t LowerBound(unsigned index);
+
+private:
+    std::atomic<uint64_t> Buckets[BUCKETS];
+    std::atomic<uint64_t> Count;
+    std::atomic<uint64_t> Sum;
+    std::atomic<uint64_t> Max;
+};
+
+
+// phases of an agent request as seen by the network layer
+enum class RequestPhase {
+    Receive,  // from socket readiness until the message is framed
+    Wait,     // for the backend's request area (Pageant channel)
+    Backend,  // Pageant round trip or cache
+    Send,
+    Total,
+
+    Count_
+};
+
+// milestones of the process timed from its start
+enum class StartupStage {
+    SshLaunched,
+    FirstReply,  // to an agent request
+
+    Count_
+};
+
+// Process-wide counters and latency histograms per ssh-agent message kind
+class Metrics {
+public:
+    using Phases = uint64_t[size_t(RequestPhase::Count_)];
+
+    static uint64_t Now();  // nanoseconds, monotonic
+
+    static void RecordRequest(uint8_t type, size_t reqLen, size_t respLen, const Phases& phases);
+    static void MarkStartup(StartupStage stage);  // only the first mark of a stage counts
+
+    static void Dump(std::ostream& os);
+
+    // components keeping counters of their own (pools of Pageant channels or agent
+    // connections) have them dumped as well while they're registered by their address
+    using Source = std::function<void(std::ostream&)>;
+    static void AddSource(const void* owner, Source source);
+    static void RemoveSource(const void* owner) noexcept;
+
+    // dumps metrics to the file periodically and when stopped
+    static void StartExport(const std::string& path, size_t intervalMs = Config::Get().MetricsIntervalMs);
+    static void StopExport();
+};
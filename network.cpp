@@ -3,196 +3,762 @@
 #include <cstring>
 #include <cassert>
 
+#include <algorithm>
+#include <chrono>
+#include <random>
 #include <thread>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <sstream>
-#include <functional>
+#include <vector>
 
 #include "network.h"
+#include "agent_proto.h"
+#include "buffer_pool.h"
+#include "framer.h"
+#include "metrics.h"
+#include "poller.h"
+#include "trace.h"
 #include "common.h"
-#include <winsock2.h>
 
-#include <Windows.h>
-#include <Winbase.h>
-
-#define LOCALHOST_ADDR "127.0.0.1"
-#define TCP_PORT 51515
+#ifdef _WIN32
+    #include <Windows.h>
+    #include <Winbase.h>
+    #include <afunix.h>
+    #define SEND_FLAGS 0
+#else
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/un.h>
+    #define SEND_FLAGS MSG_NOSIGNAL
+    #define SD_BOTH SHUT_RDWR
+#endif
 
 namespace {
 
-char buff[BUFF_SIZE];
+enum class Stage {
+    Secret,
+    Credentials,
+    Agent,
+};
 
-int Recv(SOCKET sock, char* dst, int len, int flags = 0) {
-    assert(len > 0);
-    int rc = recv(sock, dst, len, flags);
-    if (rc == SOCKET_ERROR)
-        THROW_RUNTIME_ERROR("socket recv failed: " << WSAGetLastError());
-    return rc;
+// state of a single SA client connection; it's handled by one thread at a time
+// because the socket is disarmed in the poller while being served
+struct Connection {
+    SocketHandle Sock = INVALID_SOCKET;
+    Stage State = Stage::Secret;
+    const char* Secret = nullptr;  // the client must send in the handshake
+    uint32_t Id = 0;  // for tracing
+    uint64_t Mark = 0;  // since when the current request is being received, for metrics
+
+    Framer Frames;  // received but not processed yet, responses being sent
+    char* In = nullptr;
+    char* Out = nullptr;
+
+    size_t Index = 0;  // position in the list of open connections
+
+    void Open(SocketHandle sock, uint32_t id, Stage initial, const char* secret, BufferPool& pool);
+    void Close(BufferPool& pool);
+};
+
+void Connection::Open(SocketHandle sock, uint32_t id, Stage initial, const char* secret, BufferPool& pool)
+{
+    In = pool.Acquire();
+    try {
+        Out = pool.Acquire();
+    } catch (...) {
+        pool.Release(In);
+        In = nullptr;
+        throw;
+    }
+
+    Sock = sock;
+    Id = id;
+    State = initial;
+    Secret = secret;
+    Frames.Attach(In, Out, pool.GetBlockSize());
 }
 
-int RecvExact(SOCKET sock, char* dst, unsigned len) {
-    return Recv(sock, dst, len, MSG_WAITALL);
+void Connection::Close(BufferPool& pool)
+{
+    shutdown(Sock, SD_BOTH);
+    CloseSocket(Sock);
+    Sock = INVALID_SOCKET;
+
+    pool.Release(In);
+    pool.Release(Out);
+    In = Out = nullptr;
+    Frames.Attach(nullptr, nullptr, 0);
 }
 
+// handler's request area checked out for one message
+struct Exchange {
+    Network::Handler& Handler;
+    Network::Handler::Context Ctx;
+
+    Exchange(Network::Handler& handler, uint32_t conn) : Handler(handler) {
+        Ctx.Conn = conn;
+        Handler.Begin(Ctx);
+    }
+    ~Exchange() { Handler.End(Ctx); }
+
+    Buffer Query(size_t len) { return Handler.Query(Ctx, len); }
+};
+
+// returns false if the socket can't accept more data right now
+bool Flush(Connection& conn) {
+    const size_t len = conn.Frames.GetOutputLen();
+    while (conn.Frames.HasOutput()) {
+        const Buffer unsent = conn.Frames.GetUnsent();
+        int rc = send(conn.Sock, static_cast<const char*>(unsent.ptr), int(unsent.len), SEND_FLAGS);
+        if (rc == SOCKET_ERROR) {
+            const int err = LastSocketError();
+            if (IsWouldBlock(err))
+                return false;
+            THROW_RUNTIME_ERROR("socket send failed: " << err);
+        }
+        conn.Frames.Sent(rc);
+    }
 
-// returns length of ssh-agent protocol message
-uint32_t SaMessageLen(const void *p) {
-    return ntohl(*reinterpret_cast<const uint32_t*>(p));
+    if (len)
+        TRACE(Flushed, conn.Id, len, 0);
+    return true;
 }
 
-// receive ssh-agent protocol message
-int RecvSaMessage(SOCKET sock, char* dst, unsigned len) {
-    assert(len > sizeof(uint32_t));
+// sends the queued output followed by the response with one gathering call, the
+// response right from where it is; the tail the socket doesn't accept is queued
+void Respond(Connection& conn, const Buffer& resp) {
+    if (resp.len == 0 || resp.len > SA_MAX_MESSAGE_LEN)
+        THROW_RUNTIME_ERROR("invalid response length: " << resp.len);
+
+    TRACE(Response, conn.Id, SaMessageType(resp.ptr, resp.len), resp.len);
+    const Buffer parts[] = { conn.Frames.GetUnsent(), resp };
+    const size_t skip = parts[0].len ? 0 : 1;
+
+    int rc = SendGather(conn.Sock, parts + skip, 2 - skip);
+    if (rc == SOCKET_ERROR) {
+        const int err = LastSocketError();
+        if (!IsWouldBlock(err))
+            THROW_RUNTIME_ERROR("socket send failed: " << err);
+        rc = 0;
+    }
 
-    int recvLen = RecvExact(sock, dst, sizeof(uint32_t));
-    if (recvLen == 0)
-        return 0;
+    size_t sent = rc;
+    if (parts[0].len) {
+        const size_t queued = sent < parts[0].len ? sent : parts[0].len;
+        conn.Frames.Sent(queued);
+        sent -= queued;
+    }
+    if (sent < resp.len)
+        conn.Frames.Queue(static_cast<const char*>(resp.ptr) + sent, resp.len - sent);
+}
 
-    const uint32_t msgLen = SaMessageLen(dst);
-    if (msgLen > len - sizeof(uint32_t))
-        THROW_RUNTIME_ERROR("sizeof of SA message is too big: " << msgLen);
+// records phases of a request answered at `answered` and just sent or batched
+void Account(Connection& conn, uint8_t type, size_t len, size_t respLen,
+             uint64_t wait, uint64_t backend, uint64_t answered) {
+    const uint64_t sent = Metrics::Now();
+    const uint64_t total = sent - conn.Mark;
+    const uint64_t send = sent - answered;
+    const uint64_t recv = total > wait + backend + send ? total - wait - backend - send : 0;
+
+    const Metrics::Phases phases = { recv, wait, backend, send, total };
+    Metrics::RecordRequest(type, len, respLen, phases);
+    conn.Mark = sent;
+}
 
-    recvLen += RecvExact(sock, dst + sizeof(uint32_t), msgLen);
-    return recvLen;
+// returns length of the complete message at the head of the input, zero if it's incomplete
+size_t PendingMessageLen(Connection& conn) {
+    switch (conn.State) {
+    case Stage::Secret:
+        return conn.Frames.PeekFixed(CYGWIN_SECRET_LEN);
+    case Stage::Credentials:
+        return conn.Frames.PeekFixed(CYGWIN_CRED_LEN);
+    case Stage::Agent:
+        break;
+    }
+    return conn.Frames.PeekMessage();
 }
 
+void Append(Connection& conn, const Buffer& resp) {
+    if (resp.len == 0 || resp.len > SA_MAX_MESSAGE_LEN)
+        THROW_RUNTIME_ERROR("invalid response length: " << resp.len);
 
-void ProcessClient(SOCKET sock, Network::Handler handler)
-{
-    try {
-        LOG_DEBUG("Processing SA connection started");
+    TRACE(Batched, conn.Id, SaMessageType(resp.ptr, resp.len), resp.len);
+    conn.Frames.Queue(resp.ptr, resp.len);
+}
 
-        unsigned counter = 0;
-        while (true) {
-            LOG_DEBUG("Receive message from SA client...");
-            int len = counter > 1
-                    ? RecvSaMessage(sock, buff, sizeof(buff))
-                    : Recv(sock, buff, sizeof(buff));  // first 2 messages are not about SA
+// a response is sent right away unless client's requests are pipelined,
+// then responses are batched in the output and sent with the last one
+void Reply(Connection& conn, const Buffer& resp) {
+    if (!PendingMessageLen(conn)) {
+        Respond(conn, resp);
+    } else {
+        Append(conn, resp);
+    }
+}
 
-            if (len == 0)
-                break;  // socket is closed by remote side
+// consumes one complete message from the input, if any, and responds to it;
+// returns false if there's no message or the output has to be flushed first
+bool Process(Connection& conn, Network::Handler& handler) {
+    const size_t len = PendingMessageLen(conn);
+    if (!len)
+        return false;
+
+    if (conn.Frames.GetOutputLen() >= conn.Frames.GetCapacity())
+        return false;  // flush the batch first
+
+    if (conn.State != Stage::Agent) {
+        TRACE(Handshake, conn.Id, unsigned(conn.State), len);
+        if (conn.State == Stage::Secret && std::memcmp(conn.Frames.GetInput(), conn.Secret, CYGWIN_SECRET_LEN) != 0)
+            THROW_RUNTIME_ERROR("client sent a wrong socket secret");  // closes the connection
+        conn.State = conn.State == Stage::Secret ? Stage::Credentials : Stage::Agent;
+        conn.Frames.Queue(conn.Frames.GetInput(), len);  // echo
+        conn.Frames.Consume(len);
+        return true;
+    }
 
-            LOG_DEBUG("Received message of " << len << " bytes:\n" << HexBuffer(buff, len));
-            if (counter > 1) {
-                len = handler(buff, len);
-            }
-            send(sock, buff, len, 0);
-            ++counter;
-            LOG_DEBUG("Send response of " << len << " bytes:\n" << HexBuffer(buff, len) << "\n"
-                      "Message has been processed: " << counter);
+    const uint64_t received = Metrics::Now();
+    Exchange exchange(handler, conn.Id);
+    const uint64_t acquired = Metrics::Now();
+    const uint8_t type = SaMessageType(conn.Frames.GetInput(), len);
+    TRACE(Request, conn.Id, type, len);
+    if (len > exchange.Ctx.Capacity) {
+        LOG_ERROR("SA message of " << len << " bytes doesn't fit to agent's request area");
+        static const char failure[] = { 0, 0, 0, 1, SSH_AGENT_FAILURE };
+        conn.Frames.Consume(len);
+        Reply(conn, Buffer(const_cast<char*>(failure), sizeof(failure)));
+        return true;
+    }
+
+    std::memcpy(exchange.Ctx.Area, conn.Frames.GetInput(), len);
+    conn.Frames.Consume(len);
+    const Buffer resp = exchange.Query(len);
+    const uint64_t answered = Metrics::Now();
+    Reply(conn, resp);
+    Account(conn, type, len, resp.len, acquired - received, answered - acquired, answered);
+    return true;
+}
+
+// reads as much as fits, so pipelined messages come with one call
+int RecvBuffered(Connection& conn) {
+    int rc = recv(conn.Sock, conn.Frames.GetSpace(), int(conn.Frames.GetSpaceLen()), 0);
+    if (rc > 0)
+        conn.Frames.Received(rc);
+    return rc;
+}
+
+// receives right into the handler's request area, if it's exactly one message it's
+// answered without copying, otherwise received data go to the input buffer.
+// The area (a Pageant channel or an agent connection) is only checked out once the
+// header of a message is there, not to hold it for a closed socket or a partial read.
+int RecvDirect(Connection& conn, Network::Handler& handler) {
+    assert(conn.Frames.GetInputLen() == 0 && conn.Frames.GetOutputLen() == 0);
+
+    char header[SA_HEADER_LEN];
+    const int peeked = recv(conn.Sock, header, int(sizeof(header)), MSG_PEEK);
+    if (peeked <= 0)
+        return peeked;
+    if (size_t(peeked) < sizeof(header) || SA_HEADER_LEN + SaMessageLen(header) > conn.Frames.GetCapacity())
+        return RecvBuffered(conn);  // the framer waits for the rest or takes it to the heap
+
+    const uint64_t begun = Metrics::Now();
+    Exchange exchange(handler, conn.Id);
+    const uint64_t acquired = Metrics::Now();
+    const size_t capacity = std::min(exchange.Ctx.Capacity, conn.Frames.GetCapacity());
+    int rc = recv(conn.Sock, exchange.Ctx.Area, int(capacity), 0);
+    if (rc <= 0)
+        return rc;
+
+    const size_t len = rc;
+    if (len >= SA_HEADER_LEN && SA_HEADER_LEN + SaMessageLen(exchange.Ctx.Area) == len) {
+        const uint8_t type = SaMessageType(exchange.Ctx.Area, len);
+        TRACE(Request, conn.Id, type, len);
+        const uint64_t received = Metrics::Now();
+        const Buffer resp = exchange.Query(len);
+        const uint64_t answered = Metrics::Now();
+        Respond(conn, resp);
+        Account(conn, type, len, resp.len, acquired - begun, answered - received, answered);
+    } else {
+        std::memcpy(conn.Frames.GetSpace(), exchange.Ctx.Area, len);
+        conn.Frames.Received(len);
+    }
+    return rc;
+}
+
+// advances the connection as far as possible without blocking;
+// returns poller events to wait for, or zero if the connection is finished
+unsigned Serve(Connection& conn, Network::Handler& handler) {
+    while (true) {
+        while (Process(conn, handler)) { }
+
+        if (!Flush(conn))
+            return Poller::Out;
+
+        if (PendingMessageLen(conn))
+            continue;  // processing was paused to flush the batch
+
+        int rc = conn.State == Stage::Agent && conn.Frames.GetInputLen() == 0
+                ? RecvDirect(conn, handler)
+                : RecvBuffered(conn);
+        if (rc == 0)
+            return 0;  // socket is closed by remote side
+
+        if (rc == SOCKET_ERROR) {
+            const int err = LastSocketError();
+            if (IsWouldBlock(err))
+                return Poller::In;
+            THROW_RUNTIME_ERROR("socket recv failed: " << err);
         }
+    }
+}
 
-        LOG_DEBUG("Processing SA connection successfuly finished");
-    } catch (const std::exception& exc) {
-        LOG_ERROR("Processing SA connection failed: " << exc.what());
+
+struct Listener {
+    SocketHandle Sock;
+    Stage Initial;     // of accepted connections
+    std::string Path;  // of AF_UNIX socket
+    bool Paused;       // disarmed while there are too many connections
+};
+
+// Cygwin's emulated unix socket on the loopback interface
+Listener StartListening(uint16_t& port) {
+#ifdef _WIN32
+    WSADATA wsaData = {0};
+    if (int err = WSAStartup(MAKEWORD(2, 2), &wsaData))
+        THROW_RUNTIME_ERROR("WSAStartup failed: " << err);
+#endif
+
+    SocketHandle sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("socket failed: " << LastSocketError());
+
+    LOG_DEBUG("Socket created");
+
+    try {
+        sockaddr_in addr = {};
+        SockLen addrlen = sizeof(addr);
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        addr.sin_port           = 0;
+
+        if (bind(sock, (const sockaddr*)&addr, addrlen) == SOCKET_ERROR)
+            THROW_RUNTIME_ERROR("socket binding failed: " << LastSocketError());
+
+        getsockname(sock, (sockaddr*)&addr, &addrlen);
+        LOG_DEBUG("Socket binded to " << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port));
+
+        if (listen(sock, int(Config::Get().Backlog)) == SOCKET_ERROR)
+            THROW_RUNTIME_ERROR("socket listening failed: " << LastSocketError());
+
+        SetNonBlocking(sock);
+        port = ntohs(addr.sin_port);
     } catch (...) {
-        LOG_DEBUG("Processing SA connection failed: unknown exception");
+        CloseSocket(sock);
+        throw;
+    }
+
+    LOG_DEBUG("Socket is listening");
+    return Listener{ sock, Stage::Secret, std::string(), false };
+}
+
+// native unix socket speaking plain ssh-agent protocol, Windows supports them since 10.1803
+Listener StartListeningUnix(const std::string& path) {
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path))
+        THROW_RUNTIME_ERROR("unix socket path is too long: " << path);
+
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    SocketHandle sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("unix socket failed: " << LastSocketError());
+
+    try {
+        std::remove(path.c_str());  // left by a crashed process
+        if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+            THROW_RUNTIME_ERROR("unix socket binding to " << path << " failed: " << LastSocketError());
+
+        if (listen(sock, int(Config::Get().Backlog)) == SOCKET_ERROR)
+            THROW_RUNTIME_ERROR("unix socket listening failed: " << LastSocketError());
+
+        SetNonBlocking(sock);
+    } catch (...) {
+        CloseSocket(sock);
+        std::remove(path.c_str());
+        throw;
+    }
+
+    LOG_DEBUG("Unix socket is listening on " << path);
+    return Listener{ sock, Stage::Agent, path, false };
+}
+
+// random bytes from the OS, for the secret of the socket file
+void GenerateSecret(char* secret) {
+#ifdef _WIN32
+    HCRYPTPROV provider = 0;
+    const bool ok = CryptAcquireContextA(&provider, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_SILENT)
+            && CryptGenRandom(provider, CYGWIN_SECRET_LEN, reinterpret_cast<BYTE*>(secret));
+    const DWORD err = GetLastError();
+    if (provider)
+        CryptReleaseContext(provider, 0);
+    if (!ok)
+        THROW_RUNTIME_ERROR("couldn't generate socket secret: " << err);
+#else
+    std::random_device random;  // /dev/urandom
+    for (size_t i = 0; i < CYGWIN_SECRET_LEN; i += 4) {
+        const uint32_t value = random();
+        std::memcpy(secret + i, &value, 4);
+    }
+#endif
+}
+
+}  // anoynmous namespace
+
+
+// One thread waits for readiness of the listening sockets and all connections,
+// a fixed pool of workers advances connections' state machines
+struct Network::Reactor {
+    Handler& OnMessage;
+    const size_t MaxConnections;
+    char Secret[CYGWIN_SECRET_LEN];  // a copy, the reactor may outlive the Network
+    std::vector<Listener> Listeners;
+    Poller Poll;
+    BufferPool Buffers;
+    std::atomic<bool> Running;
+    std::atomic<uint32_t> NextId;
+
+    std::mutex Mtx;
+    std::condition_variable Cv;
+    std::condition_variable DoneCv;
+    bool Draining = false;  // workers serve what's ready and quit, guarded by Mtx
+    unsigned Active = 0;    // workers not quit yet, guarded by Mtx
+    struct ReadyConnection {
+        Connection* Conn;
+        uint64_t Since;  // reported by the poller
+    };
+    std::deque<ReadyConnection> Ready;  // guarded by Mtx
+
+    // connection objects are recycled, so steady state doesn't touch the heap
+    std::mutex ConnsMtx;
+    std::vector<Connection*> Conns;  // open ones, guarded by ConnsMtx
+    std::vector<Connection*> Spare;  // guarded by ConnsMtx
+
+    std::thread Thread;
+    std::vector<std::thread> Workers;
+
+    Reactor(Handler& handler, std::vector<Listener>&& listeners, const char* secret);
+    ~Reactor();
+
+    bool Shutdown(std::chrono::milliseconds drain);
+    void Abandon();
+    void CloseListeners();
+
+    void Run();
+    void Work();
+    void Accept(Listener& listener);
+    Connection* Open(SocketHandle sock, Stage initial);
+    void Close(Connection* conn);
+};
+
+Network::Reactor::Reactor(Handler& handler, std::vector<Listener>&& listeners, const char* secret)
+    : OnMessage(handler)
+    , MaxConnections(Config::Get().MaxConnections)
+    , Listeners(std::move(listeners))
+    , Buffers(Config::Get().BufferSize, 2 * Config::Get().PooledConnections, "connections")
+    , Running(true)
+    , NextId(0)
+{
+    std::memcpy(Secret, secret, sizeof(Secret));
+    for (Listener& listener : Listeners)
+        Poll.Add(listener.Sock, Poller::In, &listener);
+
+    Thread = std::thread(&Reactor::Run, this);
+    for (size_t i = 0; i < Config::Get().Workers; ++i) {
+        Workers.emplace_back(&Reactor::Work, this);
+        ++Active;
+    }
+}
+
+Network::Reactor::~Reactor()
+{
+    for (Connection* conn : Conns) {
+        conn->Close(Buffers);
+        delete conn;
+    }
+    for (Connection* conn : Spare)
+        delete conn;
+    LOG_DEBUG("Socket thread is finished");
+}
+
+bool Network::Reactor::Shutdown(std::chrono::milliseconds drain)
+{
+    using Clock = std::chrono::steady_clock;
+    const Clock::time_point start = Clock::now();
+    const auto elapsedUs = [start] {
+        return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+    };
+
+    Running = false;
+    Poll.Wake();
+    try { Thread.join(); } catch (...) { }
+    CloseListeners();
+
+    std::unique_lock<std::mutex> lock(Mtx);
+    Draining = true;
+    Cv.notify_all();
+    if (!DoneCv.wait_for(lock, drain, [this] { return Active == 0; })) {
+        LOG_ERROR(Active << " network workers are still busy after " << elapsedUs() << " us of shutdown");
+        return false;
     }
+    lock.unlock();
+
+    for (std::thread& worker : Workers)
+        try { worker.join(); } catch (...) { }
+
+    LOG_DEBUG("Network is drained in " << elapsedUs() << " us");
+    return true;
+}
 
-    shutdown(sock, SD_BOTH);
-    closesocket(sock);
-    LOG_DEBUG("SA connection closed");
+// lets busy workers run until the process exits, the reactor is leaked for them
+void Network::Reactor::Abandon()
+{
+    for (std::thread& worker : Workers)
+        worker.detach();
+}
+
+void Network::Reactor::CloseListeners()
+{
+    std::lock_guard<std::mutex> lock(ConnsMtx);
+    for (const Listener& listener : Listeners) {
+        Poll.Remove(listener.Sock);
+        shutdown(listener.Sock, SD_BOTH);
+        CloseSocket(listener.Sock);
+        if (!listener.Path.empty())
+            std::remove(listener.Path.c_str());
+    }
+    Listeners.clear();
+    LOG_DEBUG("Socket is closed");
 }
 
-void Run(SOCKET sock, Network::Handler handler, std::atomic_flag& runFlag)
+void Network::Reactor::Run()
 {
     try {
         LOG_DEBUG("Socket thread is running...");
-        while (runFlag.test_and_set()) {
-            sockaddr_in addr;
-            int addrLen = sizeof(addr);
-
-            LOG_DEBUG("Accept new connection");
-            SOCKET remote_sock = accept(sock, (sockaddr*)&addr, &addrLen);  // it's blocking and runFlag doesn't work actually for now
-            if (remote_sock == INVALID_SOCKET) {
-                if (!runFlag.test_and_set()) {
-                    LOG_DEBUG("Socket accept interrupted via WSACleanup()");
-                    break;
+
+        std::vector<Poller::Event> events;
+        while (Running) {
+            if (!Poll.Wait(events, -1))
+                continue;  // woken up, e.g. to stop, or interrupted by a signal
+            for (const Poller::Event& ev : events) {
+                auto listener = std::find_if(Listeners.begin(), Listeners.end(),
+                                             [&ev](const Listener& l) { return &l == ev.Data; });
+                if (listener != Listeners.end()) {
+                    Accept(*listener);
+                    continue;
                 }
-                LOG_ERROR("Socket failed on accept: " << WSAGetLastError());
-                continue;
-            }
 
-            LOG_DEBUG("Socket accepted connection from " << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port));
-            try {
-                std::thread(&ProcessClient, remote_sock, handler).detach();
-                LOG_DEBUG("Connection will be processed in a detached thread");
-            } catch (const std::exception& exc) {
-                LOG_ERROR("Error in processing connection: "  << exc.what());
+                const uint64_t now = Metrics::Now();
+                {
+                    std::lock_guard<std::mutex> lock(Mtx);
+                    Ready.push_back(ReadyConnection{ static_cast<Connection*>(ev.Data), now });
+                }
+                Cv.notify_one();
             }
         }
-
-        LOG_DEBUG("Socket thread is finished");
     } catch (const std::exception& exc) {
         LOG_ERROR("Socket thread epically crashed: " << exc.what());
     } catch (...) {
         LOG_ERROR("Socket thread epically crashed: unknown exception");
     }
+}
 
-    // actually socket is closed by WSACleanup() call
-    shutdown(sock, SD_BOTH);
-    closesocket(sock);
+void Network::Reactor::Work()
+{
+    while (true) {
+        Connection* conn = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(Mtx);
+            Cv.wait(lock, [this] { return Draining || !Ready.empty(); });
+            if (Ready.empty()) {
+                if (--Active == 0)
+                    DoneCv.notify_all();
+                return;
+            }
+            conn = Ready.front().Conn;
+            conn->Mark = Ready.front().Since;
+            Ready.pop_front();
+        }
 
-    LOG_DEBUG("Socket is closed");
-}
+        unsigned events = 0;
+        try {
+            events = Serve(*conn, OnMessage);
+            if (events && Running)
+                Poll.Rearm(conn->Sock, events, conn);
+            else
+                events = 0;  // shutting down, what's received is answered
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Processing SA connection failed: " << exc.what());
+            events = 0;
+        } catch (...) {
+            LOG_ERROR("Processing SA connection failed: unknown exception");
+            events = 0;
+        }
 
-int start_network(SOCKET& sock) {
-    WSADATA wsaData = {0};
-    if (int err = WSAStartup(MAKEWORD(2, 2), &wsaData))
-        THROW_RUNTIME_ERROR("WSAStartup failed: " << err);
+        if (!events)
+            Close(conn);
+    }
+}
 
-    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock == INVALID_SOCKET)
-        THROW_RUNTIME_ERROR("socket failed: " << WSAGetLastError());
+void Network::Reactor::Accept(Listener& listener)
+{
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(ConnsMtx);
+            if (Conns.size() >= MaxConnections) {
+                // the rest waits in the backlog until some connection is closed
+                listener.Paused = true;
+                return;
+            }
+        }
 
-    LOG_DEBUG("Socket created");
+        sockaddr_storage addr;
+        SockLen addrLen = sizeof(addr);
 
-    sockaddr_in addr;
-    int addrlen = sizeof(addr);
-    addr.sin_family             = AF_INET;
-    addr.sin_addr.S_un.S_addr   = inet_addr("127.0.0.1");
-    addr.sin_port               = 0;
+        SocketHandle sock = accept(listener.Sock, (sockaddr*)&addr, &addrLen);
+        if (sock == INVALID_SOCKET) {
+            const int err = LastSocketError();
+            if (!IsWouldBlock(err))
+                LOG_ERROR("Socket failed on accept: " << err);
+            break;
+        }
 
-    if (bind(sock, (const sockaddr*)&addr, addrlen) == SOCKET_ERROR)
-        THROW_RUNTIME_ERROR("socket binding failed: " << WSAGetLastError());
+        Connection* conn = nullptr;
+        try {
+            SetNonBlocking(sock);
+            conn = Open(sock, listener.Initial);
+            TRACE(Accepted, conn->Id, unsigned(listener.Initial), 0);
+            Poll.Add(sock, Poller::In, conn);
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Error in processing connection: "  << exc.what());
+            if (conn) {
+                Close(conn);
+            } else {
+                CloseSocket(sock);
+            }
+        }
+    }
 
-    getsockname(sock, (sockaddr*)&addr, &addrlen);
-    LOG_DEBUG("Socket binded to " << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port));
+    Poll.Rearm(listener.Sock, Poller::In, &listener);
+}
 
-    if (listen(sock, 50) == SOCKET_ERROR)
-        THROW_RUNTIME_ERROR("socket listening failed: " << WSAGetLastError());
+Connection* Network::Reactor::Open(SocketHandle sock, Stage initial)
+{
+    std::lock_guard<std::mutex> lock(ConnsMtx);
+
+    Connection* conn = nullptr;
+    if (Spare.empty()) {
+        conn = new Connection();
+        Spare.reserve(Spare.size() + 1);
+    } else {
+        conn = Spare.back();
+        Spare.pop_back();
+    }
 
-    LOG_DEBUG("Socket is listening");
-    return ntohs(addr.sin_port);
+    try {
+        conn->Open(sock, ++NextId, initial, Secret, Buffers);
+        conn->Index = Conns.size();
+        Conns.push_back(conn);
+    } catch (...) {
+        Spare.push_back(conn);
+        throw;
+    }
+    return conn;
 }
 
+void Network::Reactor::Close(Connection* conn)
+{
+    Poll.Remove(conn->Sock);
 
-// global variables, sorry
-SOCKET Sock = INVALID_SOCKET;
-std::atomic_flag RunFlag;
+    TRACE(Closed, conn->Id, 0, 0);
 
-}  // anoynmous namespace
+    std::lock_guard<std::mutex> lock(ConnsMtx);
+    conn->Close(Buffers);
+
+    Conns.back()->Index = conn->Index;
+    Conns[conn->Index] = Conns.back();
+    Conns.pop_back();
+    Spare.push_back(conn);
+
+    for (Listener& listener : Listeners) {
+        if (listener.Paused && Running) {
+            listener.Paused = false;
+            Poll.Rearm(listener.Sock, Poller::In, &listener);
+        }
+    }
+}
+
+
+Network::Network(Handler& handler, const std::string& unixPath)
+{
+    GenerateSecret(Secret);
+
+    std::vector<Listener> listeners;
+    listeners.reserve(2);
+    listeners.push_back(StartListening(Port));
+
+    if (!unixPath.empty()) {
+        try {
+            listeners.push_back(StartListeningUnix(unixPath));
+            UnixPath = unixPath;
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Native unix socket is unavailable: " << exc.what());
+        }
+    }
 
+    try {
+        Impl.reset(new Reactor(handler, std::move(listeners), Secret));
+    } catch (...) {
+        for (const Listener& listener : listeners) {
+            CloseSocket(listener.Sock);
+            if (!listener.Path.empty())
+                std::remove(listener.Path.c_str());
+        }
+        throw;
+    }
+}
 
-Network::Network(Handler handler)
+bool Network::Shutdown(size_t drainMs)
 {
-    Port = start_network(Sock);
+    if (!Impl)
+        return true;
 
-    RunFlag.test_and_set();
-    Thread = std::thread(&Run, Sock, handler, std::ref(RunFlag));
+    if (!Impl->Shutdown(std::chrono::milliseconds(drainMs))) {
+        Impl->Abandon();
+        Impl.release();
+        return false;
+    }
+
+    Impl.reset();
+    return true;
 }
 
 Network::~Network()
 {
-    RunFlag.clear();
-    WSACleanup();  // it'll interrupt blocking call in Thread
+    if (!Shutdown())
+        return;  // busy workers still use sockets
 
-    try { Thread.join(); } catch (...) { }
+#ifdef _WIN32
+    WSACleanup();
+#endif
 }
 
 
 //------------------------------------------------------------------------------
 
+#ifdef _WIN32
 
 namespace {
 
@@ -211,18 +777,47 @@ std::string CreateSocketDirectory() {
 
 const char* const ENV_VAR_NAME = "SSH_AUTH_SOCK";
 
+void SetAuthSockVariable(const std::string& dirName, const std::string& fileName) {
+    const std::string envValue = std::string("/tmp") + dirName + "/" + fileName;
+    if (!SetEnvironmentVariableA(ENV_VAR_NAME, envValue.c_str())) {
+        LOG_ERROR("Couldn't set end variable: " << GetLastError());
+    }
+    LOG_DEBUG("Environment variable set: " << ENV_VAR_NAME << "=" << envValue);
+}
 
+// checks that somebody accepts connections on the port
+bool IsListening(uint16_t port) {
+    WSADATA wsaData = {0};
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData))
+        return false;
+
+    bool res = false;
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock != INVALID_SOCKET) {
+        sockaddr_in addr = {};
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        addr.sin_port           = htons(port);
+        res = connect(sock, (const sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR;
+        closesocket(sock);
+    }
+
+    WSACleanup();
+    return res;
+}
 
 }  // anonymous namespace
 
-FakeSocketFile::FakeSocketFile(uint16_t port)
+FakeSocketFile::FakeSocketFile(uint16_t port, const char* secret, const std::string& name)
 {
-    const std::string fileName = std::string("/agent.") + std::to_string(GetCurrentProcessId());
+    const std::string fileName = name.empty()
+            ? std::string("agent.") + std::to_string(GetCurrentProcessId())
+            : name;
     const std::string dirName = CreateSocketDirectory();
     const std::string fullDirName = std::string(getenv("TEMP")) + dirName;
 
     std::ostringstream os;
-    os << fullDirName << fileName;
+    os << fullDirName << "/" << fileName;
     FileName = os.str();
 
     {
@@ -231,25 +826,56 @@ FakeSocketFile::FakeSocketFile(uint16_t port)
         if (!f)
             THROW_RUNTIME_ERROR("socket file creation failed: ");
 
-        os = std::ostringstream();
-        os << "!<socket >" << port << " s F7587A34-12288B3F-DFF3A077-C4B57B4";
-        const std::string& str = os.str();
+        // Cygwin scans the secret as four hex ints and sends their bytes as they are in memory
+        uint32_t words[CYGWIN_SECRET_LEN / 4];
+        std::memcpy(words, secret, sizeof(words));
+        char str[64];
+        std::snprintf(str, sizeof(str), "!<socket >%u s %08X-%08X-%08X-%08X", unsigned(port),
+                      words[0], words[1], words[2], words[3]);
 
-        std::fwrite(str.c_str(), str.length() + 1, 1, f); // with null termination
+        std::fwrite(str, std::strlen(str) + 1, 1, f); // with null termination
         std::fclose(f);
 
-        LOG_DEBUG("Socket file created: " << FileName <<"; content: " << str);
+        LOG_DEBUG("Socket file created: " << FileName);
 
         if (!SetFileAttributesA(FileName.c_str(), FILE_ATTRIBUTE_ARCHIVE|FILE_ATTRIBUTE_SYSTEM)) {
             LOG_ERROR("couldn't set attributes");
         }
     }
 
-    const std::string envValue = std::string("/tmp") + dirName + fileName;
-    if (!SetEnvironmentVariableA(ENV_VAR_NAME, envValue.c_str())) {
-        LOG_ERROR("Couldn't set end variable: " << GetLastError());
+    SetAuthSockVariable(dirName, fileName);
+}
+
+std::string FakeSocketFile::GetPath(const std::string& name)
+{
+    return std::string(getenv("TEMP")) + CreateSocketDirectory() + "/" + name;
+}
+
+bool FakeSocketFile::Attach(const std::string& name)
+{
+    const std::string dirName = CreateSocketDirectory();
+    const std::string fullName = GetPath(name);
+
+    char content[128] = {0};
+    std::FILE* f = std::fopen(fullName.c_str(), "rb");
+    if (!f)
+        return false;
+    std::fread(content, 1, sizeof(content) - 1, f);
+    std::fclose(f);
+
+    unsigned port = 0;
+    if (std::sscanf(content, "!<socket >%u s ", &port) != 1 || port == 0 || port > 0xFFFF) {
+        LOG_ERROR("Malformed socket file " << fullName);
+        return false;
     }
-    LOG_DEBUG("Environment variable set: " << ENV_VAR_NAME << "=" << envValue);
+
+    if (!IsListening(uint16_t(port))) {
+        LOG_DEBUG("Nobody listens on port " << port << " from socket file " << fullName);
+        return false;
+    }
+
+    SetAuthSockVariable(dirName, name);
+    return true;
 }
 
 FakeSocketFile::~FakeSocketFile()
@@ -259,3 +885,5 @@ FakeSocketFile::~FakeSocketFile()
     LOG_DEBUG("Socket file " << FileName << " removed");
     SetEnvironmentVariableA(ENV_VAR_NAME, NULL);
 }
+
+#endif  // _WIN32
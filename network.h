@@ -1,33 +1,77 @@
 #pragma once
+#include "common.h"
+#include "config.h"
 #include <cstdint>
+#include <memory>
 #include <string>
-#include <thread>
 
-#define BUFF_SIZE 16384  // 16Kb should be enough for everyone
+// Cygwin emulates AF_UNIX sockets over TCP: the client sends the secret from the socket
+// file and then its credentials (pid, uid, gid), both are expected to be echoed back.
+// The secret is random per listener and checked, so only those who can read the socket
+// file (i.e. the user's processes) get to the keys, not anything reaching the port.
+#define CYGWIN_SECRET_LEN 16
+#define CYGWIN_CRED_LEN   12
 
 // must be the only one instance (singletone)
+// Listens on the loopback TCP port for Cygwin's emulated unix sockets and,
+// if a path is given, on a native unix socket speaking plain ssh-agent protocol.
 class Network {
 public:
-    using Handler = int(*)(char* buff, int len);
+    // Answers ssh-agent requests. To avoid copying, a request is received right into
+    // the area provided by Begin() (e.g. Pageant's shared memory) and the response
+    // returned by Query() is sent as is; both stay valid until End().
+    class Handler {
+    public:
+        struct Context {
+            char* Area = nullptr;
+            size_t Capacity = 0;
+            const void* Token = nullptr;  // handler's state of the request
+            uint32_t Conn = 0;            // id of the client connection
+        };
+
+        virtual ~Handler() = default;
+
+        virtual void Begin(Context& ctx) = 0;
+        virtual Buffer Query(Context& ctx, size_t len) = 0;
+        virtual void End(Context& ctx) noexcept = 0;
+    };
 
 public:
-    Network(Handler handler);
+    Network(Handler& handler, const std::string& unixPath = std::string());
     ~Network();
 
+    // Stops accepting, serves the requests already received and closes connections.
+    // Returns false if some request is still in the handler after the deadline: then
+    // the process has to exit without destroying the handler. Called by the destructor.
+    bool Shutdown(size_t drainMs = Config::Get().DrainMs);
+
     uint16_t GetPort() const { return Port; }
+    const char* GetSecret() const { return Secret; }  // CYGWIN_SECRET_LEN bytes for the socket file
+    const std::string& GetUnixPath() const { return UnixPath; }  // empty if not listening
 
 private:
+    struct Reactor;
+
     uint16_t Port;
-    std::thread Thread;
+    char Secret[CYGWIN_SECRET_LEN];
+    std::string UnixPath;
+    std::unique_ptr<Reactor> Impl;
 };
 
 
+// Cygwin's emulated AF_UNIX socket pointing to our TCP port, SSH_AUTH_SOCK is set to it.
+// Without a name the file is private to this process (agent.<pid>).
 class FakeSocketFile {
 public:
-    FakeSocketFile(uint16_t port);
+    FakeSocketFile(uint16_t port, const char* secret, const std::string& name = std::string());
     ~FakeSocketFile();
 
+    // points SSH_AUTH_SOCK to an existing socket file if its listener is alive
+    static bool Attach(const std::string& name);
+
+    // full path of a file in the directory of socket files
+    static std::string GetPath(const std::string& name);
+
 private:
     std::string FileName;
 };
-
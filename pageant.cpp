@@ -14,14 +14,17 @@
  */
 
 #include "pageant.h"
+#include "agent_proto.h"
+#include "metrics.h"
+#include "trace.h"
 #include <windows.h>
+#include <chrono>
 #include <cstring>
 #include <cinttypes>
+#include <thread>
 
 
 #define AGENT_COPYDATA_ID 0x804e50ba   /* random goop */
-#define AGENT_MAX_MSGLEN  8192
-#define SSH_AGENT_FAILURE 5
 
 
 namespace {
@@ -32,10 +35,8 @@ inline uint32_t msglen(const void *p) {
 
 HWND FindPageant() {
     HWND hwnd = FindWindowA("Pageant", "Pageant");
-    if (!hwnd)
-        THROW_RUNTIME_ERROR("Pageant window not found: " << GetLastError());
-
-    LOG_DEBUG("Pageant window found");
+    if (hwnd)
+        LOG_DEBUG("Pageant window found");
     return hwnd;
 }
 
@@ -72,11 +73,57 @@ static PSID get_user_sid(void)
     return ret;
 }
 
+// owner-only access to channels' file mappings
+class ChannelSecurity {
+public:
+    ChannelSecurity(const ChannelSecurity&) = delete;
+    ChannelSecurity& operator =(const ChannelSecurity&) = delete;
+
+    ChannelSecurity() {
+        usersid = get_user_sid();
+        if (usersid) {
+            psd = (PSECURITY_DESCRIPTOR)
+                LocalAlloc(LPTR, SECURITY_DESCRIPTOR_MIN_LENGTH);
+            if (psd) {
+                if (InitializeSecurityDescriptor
+                        (psd, SECURITY_DESCRIPTOR_REVISION)
+                        && SetSecurityDescriptorOwner(psd, usersid, FALSE)) {
+                    sa.nLength = sizeof(sa);
+                    sa.bInheritHandle = TRUE;
+                    sa.lpSecurityDescriptor = psd;
+                    psa = &sa;
+                }
+            }
+        }
+    }
+
+    ~ChannelSecurity() {
+        LocalFree(psd);
+        free(usersid);
+    }
+
+    SECURITY_ATTRIBUTES* Get() { return psa; }
+
+private:
+    PSECURITY_DESCRIPTOR psd = NULL;
+    SECURITY_ATTRIBUTES sa, *psa = NULL;
+    PSID usersid = NULL;
+};
+
+std::string ChannelName(unsigned id) {
+    // The mapping name needs to be ANSI or bad stuff happens
+    char mapname[] = "PageantRequest12345678-1234";
+    sprintf_s(mapname, sizeof(mapname), "PageantRequest%08x-%04x",
+              (unsigned)GetCurrentProcessId(), id & 0xffff);
+    return mapname;
+}
+
 }  // anonymous namespace
 
 
 FileMapping::FileMapping(const std::string& mappingName, size_t maxSize, SECURITY_ATTRIBUTES* sa)
     : Name(mappingName)
+    , Size(maxSize)
 {
     const DWORD hoMaxSize = maxSize >> sizeof(DWORD) * 8;
     const DWORD loMaxSize = maxSize & ~DWORD(0);
@@ -109,9 +156,11 @@ FileMapping::FileMapping(FileMapping&& x)
     : Name(std::move(x.Name))
     , Handle(x.Handle)
     , View(x.View)
+    , Size(x.Size)
 {
     x.Handle = nullptr;
     x.View = nullptr;
+    x.Size = 0;
 }
 
 FileMapping& FileMapping::operator =(FileMapping&& x)
@@ -119,6 +168,7 @@ FileMapping& FileMapping::operator =(FileMapping&& x)
     std::swap(Name, x.Name);
     std::swap(Handle, x.Handle);
     std::swap(View, x.View);
+    std::swap(Size, x.Size);
     return *this;
 }
 
@@ -130,73 +180,223 @@ void Pageant::MakeError(Buffer& msg)
     std::memcpy(msg.ptr, err, msg.len);
 }
 
-Pageant::Pageant()
-    : Hwnd(nullptr)
-    , Mapping()
+Pageant::Pageant(size_t channels)
+    : Retries(unsigned(Config::Get().PageantRetries))
+    , TimeoutMs(unsigned(Config::Get().PageantTimeoutMs))
+    , Hwnd(nullptr)
+    , NextChannelId(unsigned(channels))
 {
-    // The mapping name needs to be ANSI or bad stuff happens
-    char mapname[] = "PageantRequest12345678";
-    sprintf_s(mapname, sizeof(mapname), "PageantRequest%08x", (unsigned)GetCurrentThreadId());
+    // Pageant takes the message size limit from the mapping (older versions assume 8192);
+    // pages of the view are committed on first touch, so small messages cost the same
+    ChannelSecurity security;
+    Channels.reserve(channels);
+    for (size_t i = 0; i < channels; ++i)
+        Channels.emplace_back(ChannelName(unsigned(i)), Config::Get().PageantChannelSize, security.Get());
+
+    for (const FileMapping& channel : Channels)
+        FreeChannels.push_back(&channel);
+
+    // how long requests wait for a channel tells whether there are enough of them
+    Metrics::AddSource(this, [this](std::ostream& os) {
+        const ChannelStats stats = GetChannelStats();
+        os << "pageant_channels " << Channels.size() << " acquisitions " << stats.Acquisitions
+           << " waits " << stats.Waits << " wait_us " << stats.WaitTimeNs / 1000
+           << " retries " << stats.Retries << " retry_us " << stats.RetryTimeNs / 1000
+           << " timeouts " << stats.Timeouts << " refusals " << stats.Refusals << '\n';
+    });
+
+    // finds the window while the caller goes on, e.g. spawns ssh
+    Watcher = std::thread(&Pageant::Watch, this);
+}
 
-    PSECURITY_DESCRIPTOR psd = NULL;
-    SECURITY_ATTRIBUTES sa, *psa = NULL;
-    PSID usersid = get_user_sid();
-    if (usersid) {
-        psd = (PSECURITY_DESCRIPTOR)
-            LocalAlloc(LPTR, SECURITY_DESCRIPTOR_MIN_LENGTH);
-        if (psd) {
-            if (InitializeSecurityDescriptor
-                    (psd, SECURITY_DESCRIPTOR_REVISION)
-                    && SetSecurityDescriptorOwner(psd, usersid, FALSE)) {
-                sa.nLength = sizeof(sa);
-                sa.bInheritHandle = TRUE;
-                sa.lpSecurityDescriptor = psd;
-                psa = &sa;
-            }
+Pageant::~Pageant()
+{
+    Metrics::RemoveSource(this);
+    {
+        std::lock_guard<std::mutex> lock(WatchMtx);
+        WatchStop = true;
+    }
+    WatchCv.notify_all();
+    try { Watcher.join(); } catch (...) { }
+
+    LOG_DEBUG("Pageant channels: " << Stats.Acquisitions << " acquisitions, " << Stats.Waits << " waited for "
+              << Stats.WaitTimeNs / 1000 << " us in total, " << Stats.Retries << " retries for "
+              << Stats.RetryTimeNs / 1000 << " us in total, " << Stats.Timeouts << " timeouts, "
+              << Stats.Refusals << " refusals");
+}
+
+void Pageant::Watch()
+{
+    std::unique_lock<std::mutex> lock(WatchMtx);
+    do {
+        HWND hwnd = Hwnd;
+        if (!hwnd || !IsWindow(hwnd)) {
+            HWND found = FindPageant();
+            if (Hwnd.compare_exchange_strong(hwnd, found) && found)
+                TRACE(PageantFound, 0, 0, 0);
         }
+    } while (!WatchCv.wait_for(lock, std::chrono::milliseconds(PAGEANT_WATCH_INTERVAL_MS),
+                               [this] { return WatchStop; }));
+}
+
+HWND Pageant::GetWindow() const
+{
+    HWND hwnd = Hwnd;
+    if (!hwnd) {
+        hwnd = FindPageant();
+        if (hwnd)
+            Hwnd = hwnd;
     }
+    return hwnd;
+}
 
-    Mapping = FileMapping(mapname, AGENT_MAX_MSGLEN, psa);
 
-    LocalFree(psd);
-    free(usersid);
+Pageant::ChannelStats Pageant::GetChannelStats() const
+{
+    std::lock_guard<std::mutex> lock(ChannelsMtx);
+    return Stats;
 }
 
-Pageant::~Pageant()
-{ }
+const FileMapping& Pageant::AcquireChannel() const
+{
+    std::unique_lock<std::mutex> lock(ChannelsMtx);
+    ++Stats.Acquisitions;
+
+    if (FreeChannels.empty()) {
+        const auto start = std::chrono::steady_clock::now();
+        ChannelsCv.wait(lock, [this] { return !FreeChannels.empty(); });
+
+        const uint64_t waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        ++Stats.Waits;
+        Stats.WaitTimeNs += waitNs;
+        TRACE(ChannelWait, 0, waitNs, 0);
+    }
+
+    const FileMapping* channel = FreeChannels.back();
+    FreeChannels.pop_back();
+    return *channel;
+}
+
+void Pageant::ReleaseChannel(const FileMapping& channel) const noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(ChannelsMtx);
+        FreeChannels.push_back(&channel);  // never reallocates
+    }
+    ChannelsCv.notify_one();
+}
 
 
 void Pageant::Query(Buffer& msg) const
 {
-    if (!Hwnd)
-        Hwnd = FindPageant();
+    const FileMapping& channel = AcquireChannel();
+    try {
+        if (msg.len > channel.GetSize())
+            THROW_RUNTIME_ERROR("Pageant request message is too big: " << msg.len);
 
-    std::memcpy(Mapping.GetView(), msg.ptr, msg.len);
+        std::memcpy(channel.GetView(), msg.ptr, msg.len);
+        const Buffer resp = Transact(channel, msg.len);
+
+        msg.len = resp.len;
+        std::memcpy(msg.ptr, resp.ptr, resp.len);
+    } catch (...) {
+        ReleaseChannel(channel);
+        throw;
+    }
+    ReleaseChannel(channel);
+}
 
+Buffer Pageant::Transact(const FileMapping& channel, size_t len) const
+{
     COPYDATASTRUCT cds = {
         .dwData = AGENT_COPYDATA_ID,
-        .cbData = 1 + Mapping.GetName().length(),
-        .lpData = const_cast<char*>(Mapping.GetName().c_str()),
+        .cbData = 1 + channel.GetName().length(),
+        .lpData = const_cast<char*>(channel.GetName().c_str()),
     };
 
-    LRESULT id = SendMessage(Hwnd, WM_COPYDATA, (WPARAM)NULL, (LPARAM)&cds);
-    if (id == 0) {
-        DWORD err = GetLastError();
-        if (err == ERROR_INVALID_WINDOW_HANDLE) {
-            // TODO: do the same but better
-            LOG_DEBUG("Pageant's window handle became invalid, try to find it again");
-            Hwnd = nullptr;
-            return Query(msg);
+    // Pageant may be restarting: the window is looked up again with a growing pause
+    for (unsigned attempt = 1; ; ++attempt) {
+        HWND hwnd = GetWindow();
+        DWORD_PTR id = 0;
+        if (hwnd) {
+            SetLastError(0);
+            if (SendMessageTimeoutA(hwnd, WM_COPYDATA, (WPARAM)NULL, (LPARAM)&cds, SMTO_ABORTIFHUNG,
+                                    TimeoutMs, &id)) {
+                if (id != 0)
+                    break;
+                return Refused(len);  // delivered, but Pageant didn't take the request
+            }
         }
-        THROW_RUNTIME_ERROR("Pageant failed: " << err);
+
+        // no error code is set when the window is skipped as hung
+        const DWORD err = hwnd ? GetLastError() : DWORD(ERROR_INVALID_WINDOW_HANDLE);
+        if (err == ERROR_TIMEOUT || err == 0)
+            return TimedOut(channel, len);
+        if (err != ERROR_INVALID_WINDOW_HANDLE)
+            THROW_RUNTIME_ERROR("Pageant failed: " << err);
+        if (attempt >= Retries)
+            THROW_RUNTIME_ERROR("Pageant window not found after " << attempt << " attempts");
+
+        Hwnd.compare_exchange_strong(hwnd, nullptr);
+        const unsigned backoffMs = PAGEANT_RETRY_BACKOFF_MS << (attempt - 1);
+        LOG_DEBUG("Pageant's window is gone, retry in " << backoffMs << " ms");
+        TRACE(PageantRetry, 0, attempt, backoffMs);
+
+        const auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoffMs));
+        const uint64_t slept = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(ChannelsMtx);
+        ++Stats.Retries;
+        Stats.RetryTimeNs += slept;
     }
 
-    const size_t respLen = msglen(Mapping.GetView());
-    if (respLen > AGENT_MAX_MSGLEN)
+    const size_t respLen = msglen(channel.GetView());
+    if (respLen > channel.GetSize())
         THROW_RUNTIME_ERROR("Pageant response message is too big: " << respLen);
 
-    msg.len = respLen;
-    std::memcpy(msg.ptr, Mapping.GetView(),respLen);
+    TRACE(PageantQuery, 0, len, respLen);
+    return Buffer(channel.GetView(), respLen);
+}
+
+// Pageant is hung or waits for the user: the request is failed, and since Pageant
+// may still answer into the channel later, its mapping is replaced with a new one
+Buffer Pageant::TimedOut(const FileMapping& channel, size_t len) const
+{
+    LOG_ERROR("Pageant didn't answer in " << TimeoutMs << " ms");
+    TRACE(PageantTimeout, 0, len, TimeoutMs);
+    {
+        std::lock_guard<std::mutex> lock(ChannelsMtx);
+        ++Stats.Timeouts;
+    }
+
+    try {
+        ChannelSecurity security;
+        FileMapping fresh(ChannelName(NextChannelId++), channel.GetSize(), security.Get());
+        const_cast<FileMapping&>(channel) = std::move(fresh);  // the caller holds the channel
+    } catch (const std::exception& exc) {
+        LOG_ERROR("Couldn't replace Pageant channel: " << exc.what());
+    }
+
+    static const char failure[] = { 0, 0, 0, 1, SSH_AGENT_FAILURE };
+    return Buffer(const_cast<char*>(failure), sizeof(failure));
+}
+
+// Pageant answered the window message with zero, e.g. it couldn't open the mapping
+// or it's locked down: the channel is intact, so only the request fails
+Buffer Pageant::Refused(size_t len) const
+{
+    LOG_ERROR("Pageant refused the request");
+    TRACE(PageantRefused, 0, len, 0);
+    {
+        std::lock_guard<std::mutex> lock(ChannelsMtx);
+        ++Stats.Refusals;
+    }
+
+    static const char failure[] = { 0, 0, 0, 1, SSH_AGENT_FAILURE };
+    return Buffer(const_cast<char*>(failure), sizeof(failure));
 }
 
 void Pageant::TryQuery(Buffer& msg) const noexcept
@@ -208,4 +408,3 @@ void Pageant::TryQuery(Buffer& msg) const noexcept
         MakeError(msg);
     }
 }
-
@@ -1,5 +1,12 @@
 #pragma once
 #include "common.h"
+#include "config.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <windef.h>
 #include <winbase.h>
 
@@ -20,15 +27,24 @@ public:
 
     const std::string& GetName() const { return Name; }
     void* GetView() const { return View; }
+    size_t GetSize() const { return Size; }
 
 private:
     std::string Name;
     HANDLE Handle = nullptr;
     void* View = nullptr;
+    size_t Size = 0;
 };
 
 
-// For now only one instance can work correctly
+#define PAGEANT_WATCH_INTERVAL_MS 1000  // how often the window is checked for Pageant restarts
+#define PAGEANT_RETRY_BACKOFF_MS 20     // doubled after each failed attempt
+
+
+// Requests are passed to Pageant through a pool of independent file mappings (channels),
+// so queries from different connections don't wait for each other. Pageant's window is
+// looked up by a background thread from the start and again whenever Pageant restarts,
+// so queries normally find it cached.
 class Pageant {
 public:
     Pageant(const Pageant&) = delete;
@@ -36,15 +52,52 @@ public:
 
     static void MakeError(Buffer& msg);
 
+    struct ChannelStats {
+        uint64_t Acquisitions = 0;
+        uint64_t Waits = 0;       // acquisitions found no free channel
+        uint64_t WaitTimeNs = 0;  // total time spent waiting for a channel
+        uint64_t Retries = 0;     // queries repeated because Pageant's window was gone
+        uint64_t RetryTimeNs = 0; // total backoff
+        uint64_t Timeouts = 0;    // queries failed because Pageant didn't answer in time
+        uint64_t Refusals = 0;    // queries Pageant declined to answer
+    };
+
 public:
-    Pageant();
+    Pageant(size_t channels = Config::Get().PageantChannels);
     ~Pageant();
 
     void Query(Buffer& msg) const;
     void TryQuery(Buffer& msg) const noexcept;
 
+    // Zero-copy interface: a request is written right into the view of an acquired
+    // channel, the returned response points into the view until the channel is released
+    const FileMapping& AcquireChannel() const;
+    void ReleaseChannel(const FileMapping& channel) const noexcept;
+    Buffer Transact(const FileMapping& channel, size_t len) const;
+
+    ChannelStats GetChannelStats() const;
+
 private:
-    mutable HWND Hwnd;
-    FileMapping Mapping;
-};
+    HWND GetWindow() const;  // nullptr if Pageant isn't running
+    Buffer TimedOut(const FileMapping& channel, size_t len) const;
+    Buffer Refused(size_t len) const;
+    void Watch();
 
+private:
+    const unsigned Retries;
+    const unsigned TimeoutMs;
+    mutable std::atomic<HWND> Hwnd;
+
+    std::mutex WatchMtx;
+    std::condition_variable WatchCv;
+    bool WatchStop = false;  // guarded by WatchMtx
+    std::thread Watcher;
+
+    std::vector<FileMapping> Channels;
+    mutable std::atomic<unsigned> NextChannelId;  // names of channels replaced after a timeout
+
+    mutable std::mutex ChannelsMtx;
+    mutable std::condition_variable ChannelsCv;
+    mutable std::vector<const FileMapping*> FreeChannels;  // guarded by ChannelsMtx
+    mutable ChannelStats Stats;                            // guarded by ChannelsMtx
+};
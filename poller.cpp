@@ -0,0 +1,353 @@
+#include "poller.h"
+#include "common.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+    #include <ws2tcpip.h>
+    #define poll WSAPoll
+#else
+    #include <cerrno>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+#endif
+
+
+int LastSocketError()
+{
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+bool IsWouldBlock(int err)
+{
+#ifdef _WIN32
+    return err == WSAEWOULDBLOCK;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK;
+#endif
+}
+
+void SetNonBlocking(SocketHandle sock)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    if (ioctlsocket(sock, FIONBIO, &mode) == SOCKET_ERROR)
+        THROW_RUNTIME_ERROR("couldn't make socket non-blocking: " << WSAGetLastError());
+#else
+    const int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+        THROW_RUNTIME_ERROR("couldn't make socket non-blocking: " << errno);
+#endif
+}
+
+void CloseSocket(SocketHandle sock)
+{
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+int SendGather(SocketHandle sock, const Buffer* parts, size_t count)
+{
+    enum { MAX_PARTS = 4 };
+    if (count > MAX_PARTS)
+        count = MAX_PARTS;  // the rest is sent by the next call
+
+#ifdef _WIN32
+    WSABUF bufs[MAX_PARTS];
+    for (size_t i = 0; i < count; ++i) {
+        bufs[i].buf = static_cast<char*>(parts[i].ptr);
+        bufs[i].len = ULONG(parts[i].len);
+    }
+
+    DWORD sent = 0;
+    if (WSASend(sock, bufs, DWORD(count), &sent, 0, NULL, NULL) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return int(sent);
+#else
+    iovec bufs[MAX_PARTS];
+    for (size_t i = 0; i < count; ++i) {
+        bufs[i].iov_base = parts[i].ptr;
+        bufs[i].iov_len = parts[i].len;
+    }
+
+    msghdr msg = {};
+    msg.msg_iov = bufs;
+    msg.msg_iovlen = count;
+    return int(sendmsg(sock, &msg, MSG_NOSIGNAL));
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+namespace {
+
+#ifdef _WIN32
+// Winsock has no pipes, so a loopback UDP socket connected to itself wakes WSAPoll()
+void CreateWaker(SocketHandle& recvSock, SocketHandle& sendSock) {
+    SocketHandle sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("waker socket failed: " << WSAGetLastError());
+
+    sockaddr_in addr = {};
+    int addrLen = sizeof(addr);
+    addr.sin_family             = AF_INET;
+    addr.sin_addr.S_un.S_addr   = htonl(INADDR_LOOPBACK);
+    addr.sin_port               = 0;
+
+    if (bind(sock, (const sockaddr*)&addr, addrLen) == SOCKET_ERROR
+            || getsockname(sock, (sockaddr*)&addr, &addrLen) == SOCKET_ERROR
+            || connect(sock, (const sockaddr*)&addr, addrLen) == SOCKET_ERROR) {
+        const int err = WSAGetLastError();
+        closesocket(sock);
+        THROW_RUNTIME_ERROR("waker socket setup failed: " << err);
+    }
+
+    SetNonBlocking(sock);
+    recvSock = sendSock = sock;
+}
+
+void DestroyWaker(SocketHandle recvSock, SocketHandle) {
+    closesocket(recvSock);
+}
+#else
+void CreateWaker(SocketHandle& recvSock, SocketHandle& sendSock) {
+    int fds[2];
+    if (pipe(fds) == -1)
+        THROW_RUNTIME_ERROR("waker pipe failed: " << errno);
+
+    SetNonBlocking(fds[0]);
+    SetNonBlocking(fds[1]);
+    recvSock = fds[0];
+    sendSock = fds[1];
+}
+
+void DestroyWaker(SocketHandle recvSock, SocketHandle sendSock) {
+    close(recvSock);
+    close(sendSock);
+}
+#endif
+
+void DrainWaker(SocketHandle sock) {
+    char dummy[64];
+#ifdef _WIN32
+    while (recv(sock, dummy, sizeof(dummy), 0) > 0) { }
+#else
+    while (read(sock, dummy, sizeof(dummy)) > 0) { }
+#endif
+}
+
+}  // anonymous namespace
+
+
+void Poller::Wake()
+{
+    const char c = 0;
+#ifdef _WIN32
+    send(WakeSend, &c, 1, 0);
+#else
+    ssize_t rc = write(WakeSend, &c, 1);
+    (void)rc;  // pipe is full, so Wait() is going to wake up anyway
+#endif
+}
+
+
+#ifdef __linux__
+
+namespace {
+
+uint32_t ToEpollEvents(unsigned events) {
+    uint32_t res = EPOLLONESHOT;
+    if (events & Poller::In)
+        res |= EPOLLIN;
+    if (events & Poller::Out)
+        res |= EPOLLOUT;
+    return res;
+}
+
+}  // anonymous namespace
+
+Poller::Poller()
+{
+    Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (Epoll == -1)
+        THROW_RUNTIME_ERROR("epoll_create1 failed: " << errno);
+
+    try {
+        CreateWaker(WakeRecv, WakeSend);
+    } catch (...) {
+        close(Epoll);
+        throw;
+    }
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;  // level triggered, it's drained in Wait()
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, WakeRecv, &ev) == -1) {
+        const int err = errno;
+        DestroyWaker(WakeRecv, WakeSend);
+        close(Epoll);
+        THROW_RUNTIME_ERROR("epoll_ctl for waker failed: " << err);
+    }
+}
+
+Poller::~Poller()
+{
+    DestroyWaker(WakeRecv, WakeSend);
+    close(Epoll);
+}
+
+void Poller::Add(SocketHandle sock, unsigned events, void* data)
+{
+    epoll_event ev = {};
+    ev.events = ToEpollEvents(events);
+    ev.data.ptr = data;
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, sock, &ev) == -1)
+        THROW_RUNTIME_ERROR("epoll_ctl(ADD) failed: " << errno);
+}
+
+void Poller::Rearm(SocketHandle sock, unsigned events, void* data)
+{
+    epoll_event ev = {};
+    ev.events = ToEpollEvents(events);
+    ev.data.ptr = data;
+    if (epoll_ctl(Epoll, EPOLL_CTL_MOD, sock, &ev) == -1)
+        THROW_RUNTIME_ERROR("epoll_ctl(MOD) failed: " << errno);
+}
+
+void Poller::Remove(SocketHandle sock)
+{
+    epoll_ctl(Epoll, EPOLL_CTL_DEL, sock, nullptr);
+}
+
+size_t Poller::Wait(std::vector<Event>& events, int timeoutMs)
+{
+    events.clear();  // the caller's previous batch mustn't be seen again if interrupted
+    epoll_event fired[64];
+    const int n = epoll_wait(Epoll, fired, sizeof(fired) / sizeof(fired[0]), timeoutMs);
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        THROW_RUNTIME_ERROR("epoll_wait failed: " << errno);
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (!fired[i].data.ptr) {
+            DrainWaker(WakeRecv);
+            continue;
+        }
+
+        unsigned ev = 0;
+        if (fired[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ev |= In;
+        if (fired[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            ev |= Out;
+        events.push_back(Event{ ev, fired[i].data.ptr });
+    }
+    return events.size();
+}
+
+#else  // portable poll() based implementation
+
+Poller::Poller()
+{
+    CreateWaker(WakeRecv, WakeSend);
+}
+
+Poller::~Poller()
+{
+    DestroyWaker(WakeRecv, WakeSend);
+}
+
+void Poller::Add(SocketHandle sock, unsigned events, void* data)
+{
+    Rearm(sock, events, data);
+}
+
+void Poller::Rearm(SocketHandle sock, unsigned events, void* data)
+{
+    {
+        std::lock_guard<std::mutex> lock(Mtx);
+        Pending.push_back(Registration{ sock, events, data });
+    }
+    Wake();
+}
+
+void Poller::Remove(SocketHandle sock)
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    Pending.push_back(Registration{ sock, 0, nullptr });
+}
+
+size_t Poller::Wait(std::vector<Event>& events, int timeoutMs)
+{
+    events.clear();  // the caller's previous batch mustn't be seen again if interrupted
+    {
+        std::lock_guard<std::mutex> lock(Mtx);
+        for (const Registration& reg : Pending) {
+            auto it = std::find_if(Armed.begin(), Armed.end(),
+                                   [&reg](const Registration& r) { return r.Sock == reg.Sock; });
+            if (it != Armed.end())
+                Armed.erase(it);
+            if (reg.Events)
+                Armed.push_back(reg);
+        }
+        Pending.clear();
+    }
+
+    std::vector<pollfd> fds(1 + Armed.size());
+    fds[0].fd = WakeRecv;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < Armed.size(); ++i) {
+        fds[i + 1].fd = Armed[i].Sock;
+        fds[i + 1].events = (Armed[i].Events & In ? POLLIN : 0) | (Armed[i].Events & Out ? POLLOUT : 0);
+    }
+
+    const int n = poll(fds.data(), fds.size(), timeoutMs);
+    if (n == SOCKET_ERROR) {
+        const int err = LastSocketError();
+#ifndef _WIN32
+        if (err == EINTR)
+            return 0;
+#endif
+        THROW_RUNTIME_ERROR("poll failed: " << err);
+    }
+
+    if (fds[0].revents)
+        DrainWaker(WakeRecv);
+
+    size_t armed = 0;
+    for (size_t i = 0; i < Armed.size(); ++i) {
+        const short revents = fds[i + 1].revents;
+        if (!revents) {
+            Armed[armed++] = Armed[i];
+            continue;
+        }
+
+        unsigned ev = 0;
+        if (revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+            ev |= In;
+        if (revents & (POLLOUT | POLLHUP | POLLERR | POLLNVAL))
+            ev |= Out;
+        events.push_back(Event{ ev, Armed[i].Data });  // one-shot: disarmed
+    }
+    Armed.resize(armed);
+    return events.size();
+}
+
+#endif
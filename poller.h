@@ -0,0 +1,83 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    using SocketHandle = SOCKET;
+    using SockLen = int;
+#else
+    #include <sys/socket.h>
+    using SocketHandle = int;
+    using SockLen = socklen_t;
+    #define INVALID_SOCKET (-1)
+    #define SOCKET_ERROR   (-1)
+#endif
+
+
+// thin portable layer over Winsock and BSD sockets
+int LastSocketError();
+bool IsWouldBlock(int err);
+void SetNonBlocking(SocketHandle sock);
+void CloseSocket(SocketHandle sock);
+
+// sends the parts with one call (WSASend()/sendmsg()), returns bytes sent or SOCKET_ERROR
+int SendGather(SocketHandle sock, const Buffer* parts, size_t count);
+
+
+// Readiness notifications for a set of sockets: epoll on Linux, poll()/WSAPoll()
+// elsewhere. Every registration is one-shot: once an event is reported the socket
+// is disarmed until Rearm() is called, so only one thread handles a socket at a time.
+// Add(), Rearm(), Remove() and Wake() may be called from any thread.
+class Poller {
+public:
+    Poller(const Poller&) = delete;
+    Poller& operator =(const Poller&) = delete;
+
+    enum : unsigned {
+        In  = 1,
+        Out = 2,
+    };
+
+    struct Event {
+        unsigned Events;
+        void* Data;
+    };
+
+public:
+    Poller();
+    ~Poller();
+
+    void Add(SocketHandle sock, unsigned events, void* data);
+    void Rearm(SocketHandle sock, unsigned events, void* data);
+    void Remove(SocketHandle sock);
+
+    // interrupts a blocking Wait()
+    void Wake();
+
+    // blocks until some sockets are ready, Wake() is called or timeout expires;
+    // negative timeout means infinite wait. Replaces `events` with the ready ones,
+    // none if it's been woken up or interrupted by a signal.
+    size_t Wait(std::vector<Event>& events, int timeoutMs);
+
+private:
+    SocketHandle WakeRecv = INVALID_SOCKET;
+    SocketHandle WakeSend = INVALID_SOCKET;
+
+#ifdef __linux__
+    int Epoll = -1;
+#else
+    struct Registration {
+        SocketHandle Sock;
+        unsigned Events;  // zero means removal
+        void* Data;
+    };
+
+    std::mutex Mtx;
+    std::vector<Registration> Pending;  // guarded by Mtx
+    std::vector<Registration> Armed;    // owned by the thread in Wait()
+#endif
+};
@@ -0,0 +1,551 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "agent_proto.h"
+#include "backend.h"
+#include "network.h"
+#include "poller.h"
+#include "common.h"
+
+#include <fcntl.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define RELAY_BENCH_SECONDS 3
+#define RELAY_BENCH_CONNECTIONS 8
+#define RELAY_BENCH_DATA_LEN 4096  // of a benchmark's signature request
+
+// Linux-only. Forwards ssh-agent connections accepted on a unix socket to an upstream
+// agent, one upstream connection per client. Messages are moved with splice() through
+// a pipe, so only their 4-byte headers are ever read into user space.
+const char* const USAGE =
+    "usage: ssh-pageant-wrap-relay <socket> [<upstream socket>]  relay to an agent ($SSH_AUTH_SOCK by default)\n"
+    "       ssh-pageant-wrap-relay --serve <socket> [<backend spec>]  serve a backend (stub by default)\n"
+    "       ssh-pageant-wrap-relay --bench [<data bytes> [<seconds> [<connections>]]]  measure throughput";
+
+namespace {
+
+SocketHandle ConnectUnix(const std::string& path) {
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path))
+        THROW_RUNTIME_ERROR("unix socket path is too long: " << path);
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    SocketHandle sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("unix socket failed: " << LastSocketError());
+
+    if (connect(sock, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        const int err = LastSocketError();
+        CloseSocket(sock);
+        THROW_RUNTIME_ERROR("couldn't connect to " << path << ": " << err);
+    }
+    return sock;
+}
+
+SocketHandle ListenUnix(const std::string& path) {
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path))
+        THROW_RUNTIME_ERROR("unix socket path is too long: " << path);
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    SocketHandle sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        THROW_RUNTIME_ERROR("unix socket failed: " << LastSocketError());
+
+    std::remove(path.c_str());  // left by a crashed process
+    if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR
+            || listen(sock, int(Config::Get().Backlog)) == SOCKET_ERROR) {
+        const int err = LastSocketError();
+        CloseSocket(sock);
+        THROW_RUNTIME_ERROR("couldn't listen on " << path << ": " << err);
+    }
+    SetNonBlocking(sock);
+    return sock;
+}
+
+
+// one direction of a relayed connection: messages are spliced from one socket to the
+// other through a pipe, only the header is received to know where a message ends
+class Pump {
+public:
+    Pump(const Pump&) = delete;
+    Pump& operator =(const Pump&) = delete;
+
+    enum class Wait {
+        Readable,  // the source
+        Writable,  // the destination
+        Closed,    // the source between messages
+    };
+
+public:
+    Pump(SocketHandle from, SocketHandle to);
+    ~Pump();
+
+    // moves data until one of the sockets would block
+    Wait Run();
+
+    uint64_t GetMessages() const { return Messages; }
+    uint64_t GetBytes() const { return Bytes; }
+
+private:
+    SocketHandle From;
+    SocketHandle To;
+    int Pipe[2] = { -1, -1 };
+    char Header[SA_HEADER_LEN];
+    size_t HeaderLen = 0;
+    size_t Left = 0;    // of the current message still in the source socket
+    size_t InPipe = 0;  // bytes spliced into the pipe, not yet out of it
+    uint64_t Messages = 0;
+    uint64_t Bytes = 0;
+};
+
+Pump::Pump(SocketHandle from, SocketHandle to)
+    : From(from)
+    , To(to)
+{
+    if (pipe2(Pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        THROW_RUNTIME_ERROR("pipe failed: " << errno);
+}
+
+Pump::~Pump()
+{
+    close(Pipe[0]);
+    close(Pipe[1]);
+}
+
+Pump::Wait Pump::Run()
+{
+    while (true) {
+        if (InPipe) {
+            const ssize_t n = splice(Pipe[0], nullptr, To, nullptr, InPipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN)
+                    return Wait::Writable;
+                THROW_RUNTIME_ERROR("splice to socket failed: " << errno);
+            }
+            InPipe -= n;
+            continue;
+        }
+
+        if (Left) {
+            const ssize_t n = splice(From, nullptr, Pipe[1], nullptr, Left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN)
+                    return Wait::Readable;
+                THROW_RUNTIME_ERROR("splice from socket failed: " << errno);
+            }
+            if (n == 0)
+                THROW_RUNTIME_ERROR("connection closed in the middle of a message");
+            Left -= n;
+            InPipe += n;
+            continue;
+        }
+
+        const int rc = recv(From, Header + HeaderLen, int(SA_HEADER_LEN - HeaderLen), 0);
+        if (rc == SOCKET_ERROR) {
+            const int err = LastSocketError();
+            if (IsWouldBlock(err))
+                return Wait::Readable;
+            THROW_RUNTIME_ERROR("socket recv failed: " << err);
+        }
+        if (rc == 0) {
+            if (HeaderLen)
+                THROW_RUNTIME_ERROR("connection closed in the middle of a message");
+            return Wait::Closed;
+        }
+
+        HeaderLen += rc;
+        if (HeaderLen < SA_HEADER_LEN)
+            continue;
+
+        const size_t len = SaMessageLen(Header);
+        if (len == 0 || len > SA_MAX_MESSAGE_LEN)
+            THROW_RUNTIME_ERROR("invalid SA message length: " << len);
+
+        // the pipe is empty, so the header always fits
+        if (write(Pipe[1], Header, SA_HEADER_LEN) != SA_HEADER_LEN)
+            THROW_RUNTIME_ERROR("pipe write failed: " << errno);
+
+        HeaderLen = 0;
+        InPipe = SA_HEADER_LEN;
+        Left = len;
+        ++Messages;
+        Bytes += SA_HEADER_LEN + len;
+    }
+}
+
+
+// a client connection with its own upstream one
+struct Session {
+    SocketHandle Client;
+    SocketHandle Upstream;
+    Pump Requests;
+    Pump Responses;
+    bool Closed = false;
+
+    Session(SocketHandle client, SocketHandle upstream)
+        : Client(client), Upstream(upstream), Requests(client, upstream), Responses(upstream, client) { }
+};
+
+
+// single-threaded: the kernel does the copying, the thread only decides what to splice
+class Relay {
+public:
+    Relay(const Relay&) = delete;
+    Relay& operator =(const Relay&) = delete;
+
+public:
+    Relay(const std::string& path, const std::string& upstream);
+    ~Relay();
+
+    // serves connections until Stop() is called
+    void Run();
+
+    // may be called from a signal handler
+    void Stop();
+
+private:
+    void Accept();
+    void Serve(Session* session);
+    void Close(Session* session);
+
+private:
+    std::string Path;
+    std::string Upstream;
+    SocketHandle Listener;
+    Poller Poll;
+    std::atomic<bool> Running;
+    std::vector<std::unique_ptr<Session>> Sessions;
+
+    uint64_t Accepted = 0;
+    uint64_t Requests = 0;
+    uint64_t RequestBytes = 0;
+    uint64_t Responses = 0;
+    uint64_t ResponseBytes = 0;
+};
+
+Relay::Relay(const std::string& path, const std::string& upstream)
+    : Path(path)
+    , Upstream(upstream)
+    , Listener(ListenUnix(path))
+    , Running(true)
+{
+    Poll.Add(Listener, Poller::In, this);
+    LOG_DEBUG("Relaying " << Path << " to " << Upstream);
+}
+
+Relay::~Relay()
+{
+    for (std::unique_ptr<Session>& session : Sessions)
+        Close(session.get());
+    Poll.Remove(Listener);
+    CloseSocket(Listener);
+    std::remove(Path.c_str());
+
+    std::cerr << "Relay: " << Accepted << " connections, " << Requests << " requests of " << RequestBytes
+              << " bytes, " << Responses << " responses of " << ResponseBytes << " bytes" << std::endl;
+}
+
+void Relay::Stop()
+{
+    Running = false;
+    Poll.Wake();
+}
+
+void Relay::Run()
+{
+    std::vector<Poller::Event> events;
+    while (Running) {
+        if (!Poll.Wait(events, -1))
+            continue;  // woken up to stop or interrupted by SIGINT/SIGTERM
+        for (const Poller::Event& ev : events) {
+            if (ev.Data == this) {
+                Accept();
+            } else {
+                Serve(static_cast<Session*>(ev.Data));
+            }
+        }
+
+        // both sockets of a closed session may be in the same batch, so it's freed afterwards
+        for (size_t i = 0; i < Sessions.size(); ) {
+            if (Sessions[i]->Closed) {
+                Sessions[i] = std::move(Sessions.back());
+                Sessions.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+void Relay::Accept()
+{
+    while (true) {
+        SocketHandle client = accept(Listener, nullptr, nullptr);
+        if (client == INVALID_SOCKET) {
+            const int err = LastSocketError();
+            if (!IsWouldBlock(err))
+                LOG_ERROR("Socket failed on accept: " << err);
+            break;
+        }
+
+        SocketHandle upstream = INVALID_SOCKET;
+        try {
+            upstream = ConnectUnix(Upstream);
+            SetNonBlocking(client);
+            SetNonBlocking(upstream);
+            Sessions.emplace_back(new Session(client, upstream));
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Couldn't relay connection: " << exc.what());
+            CloseSocket(client);
+            if (upstream != INVALID_SOCKET)
+                CloseSocket(upstream);
+            continue;
+        }
+
+        ++Accepted;
+        Session* session = Sessions.back().get();
+        Poll.Add(client, Poller::In, session);
+        Poll.Add(upstream, Poller::In, session);
+    }
+
+    Poll.Rearm(Listener, Poller::In, this);
+}
+
+void Relay::Serve(Session* session)
+{
+    if (session->Closed)
+        return;
+
+    try {
+        const Pump::Wait requests = session->Requests.Run();
+        const Pump::Wait responses = session->Responses.Run();
+        if (requests == Pump::Wait::Closed || responses == Pump::Wait::Closed) {
+            Close(session);
+            return;
+        }
+
+        // one-shot registrations, so both sockets are armed for what they wait for now
+        const unsigned client = (requests == Pump::Wait::Readable ? unsigned(Poller::In) : 0u)
+                | (responses == Pump::Wait::Writable ? unsigned(Poller::Out) : 0u);
+        const unsigned upstream = (responses == Pump::Wait::Readable ? unsigned(Poller::In) : 0u)
+                | (requests == Pump::Wait::Writable ? unsigned(Poller::Out) : 0u);
+        Poll.Rearm(session->Client, client, session);
+        Poll.Rearm(session->Upstream, upstream, session);
+    } catch (const std::exception& exc) {
+        LOG_ERROR("Relaying SA connection failed: " << exc.what());
+        Close(session);
+    }
+}
+
+void Relay::Close(Session* session)
+{
+    if (session->Closed)
+        return;
+
+    Requests += session->Requests.GetMessages();
+    RequestBytes += session->Requests.GetBytes();
+    Responses += session->Responses.GetMessages();
+    ResponseBytes += session->Responses.GetBytes();
+
+    for (SocketHandle sock : { session->Client, session->Upstream }) {
+        Poll.Remove(sock);
+        CloseSocket(sock);
+    }
+    session->Closed = true;
+}
+
+
+std::atomic<bool> Interrupted(false);
+
+void OnSignal(int) {
+    Interrupted = true;
+}
+
+void WaitForSignal() {
+    std::signal(SIGINT, OnSignal);
+    std::signal(SIGTERM, OnSignal);
+    while (!Interrupted)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+
+// sends signature requests over one connection until the deadline, returns their number
+uint64_t Load(const std::string& path, size_t dataLen, std::chrono::steady_clock::time_point deadline) {
+    static const char KEY[] = "relay-bench-key";
+    const size_t keyLen = sizeof(KEY) - 1;
+    const size_t bodyLen = 1 + 4 + keyLen + 4 + dataLen + 4;
+
+    std::vector<char> req(SA_HEADER_LEN + bodyLen);
+    char* p = req.data();
+    const auto put = [&p](uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            *p++ = char(value >> shift);
+    };
+    put(uint32_t(bodyLen));
+    *p++ = char(SSH2_AGENTC_SIGN_REQUEST);
+    put(uint32_t(keyLen));
+    p = std::copy(KEY, KEY + keyLen, p);
+    put(uint32_t(dataLen));
+    p += dataLen;
+    put(0);
+
+    // the stub agent's answer, every response must match it byte for byte
+    std::vector<char> expected(SA_HEADER_LEN + 1 + 4 + STUB_SIGNATURE_LEN);
+    p = expected.data();
+    put(uint32_t(expected.size() - SA_HEADER_LEN));
+    *p++ = char(SSH2_AGENT_SIGN_RESPONSE);
+    put(uint32_t(STUB_SIGNATURE_LEN));
+
+    SocketHandle sock = ConnectUnix(path);
+    std::vector<char> resp(SA_MAX_MESSAGE_LEN);
+    uint64_t count = 0;
+    try {
+        while (std::chrono::steady_clock::now() < deadline) {
+            for (size_t sent = 0; sent < req.size(); ) {
+                const int rc = send(sock, req.data() + sent, int(req.size() - sent), MSG_NOSIGNAL);
+                if (rc <= 0)
+                    THROW_RUNTIME_ERROR("benchmark send failed: " << LastSocketError());
+                sent += rc;
+            }
+
+            size_t received = 0;
+            size_t len = SA_HEADER_LEN;
+            while (received < len) {
+                const int rc = recv(sock, resp.data() + received, int(len - received), 0);
+                if (rc <= 0)
+                    THROW_RUNTIME_ERROR("benchmark recv failed: " << LastSocketError());
+                received += rc;
+                if (received == SA_HEADER_LEN) {
+                    len = SA_HEADER_LEN + SaMessageLen(resp.data());
+                    if (len > resp.size())
+                        THROW_RUNTIME_ERROR("benchmark response is too big: " << len);
+                }
+            }
+            if (len != expected.size() || !std::equal(expected.begin(), expected.end(), resp.begin()))
+                THROW_RUNTIME_ERROR("benchmark response #" << count << " of " << len << " bytes isn't the stub's signature");
+            ++count;
+        }
+    } catch (...) {
+        CloseSocket(sock);
+        throw;
+    }
+    CloseSocket(sock);
+    return count;
+}
+
+void Bench(const char* name, const std::string& path, size_t dataLen, unsigned seconds, unsigned connections) {
+    std::atomic<uint64_t> requests(0);
+    std::atomic<unsigned> failures(0);
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + std::chrono::seconds(seconds);
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < connections; ++i) {
+        threads.emplace_back([&] {
+            try {
+                requests += Load(path, dataLen, deadline);
+            } catch (const std::exception& exc) {
+                LOG_ERROR(exc.what());
+                ++failures;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const double rate = requests / elapsed;
+    std::cout << std::fixed << std::setprecision(1) << name << ": " << requests << " requests in "
+              << elapsed << " s, " << rate << " requests/s, " << rate * dataLen / (1024 * 1024)
+              << " MiB/s of request data";
+    if (failures)
+        std::cout << ", " << failures << " connections failed";
+    std::cout << std::endl;
+}
+
+// the stub agent answered directly and through the relay
+int RunBench(size_t dataLen, unsigned seconds, unsigned connections) {
+    const std::string base = "/tmp/ssh-pageant-wrap-bench." + std::to_string(getpid());
+    const std::string agentPath = base + ".agent";
+    const std::string relayPath = base + ".relay";
+
+    const std::unique_ptr<AgentBackend> stub = AgentBackend::Create("stub");
+    Network net(*stub, agentPath);
+    if (net.GetUnixPath().empty())
+        THROW_RUNTIME_ERROR("couldn't listen on " << agentPath);
+
+    Relay relay(relayPath, agentPath);
+    std::thread thread(&Relay::Run, &relay);
+
+    std::cout << connections << " connections, signature requests with " << dataLen << " bytes of data" << std::endl;
+    Bench("direct ", agentPath, dataLen, seconds, connections);
+    Bench("relayed", relayPath, dataLen, seconds, connections);
+
+    relay.Stop();
+    thread.join();
+    return 0;
+}
+
+}  // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+    std::signal(SIGPIPE, SIG_IGN);  // splice() to a closed socket raises it
+
+    const std::string mode = argc > 1 ? argv[1] : "";
+    try {
+        if (mode == "--bench" && argc <= 5) {
+            const size_t dataLen = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : RELAY_BENCH_DATA_LEN;
+            const unsigned seconds = argc > 3 ? std::atoi(argv[3]) : RELAY_BENCH_SECONDS;
+            const unsigned connections = argc > 4 ? std::atoi(argv[4]) : RELAY_BENCH_CONNECTIONS;
+            if (dataLen > SA_MAX_MESSAGE_LEN / 2 || connections == 0)
+                THROW_RUNTIME_ERROR(USAGE);
+            return RunBench(dataLen, seconds, connections);
+        }
+
+        if (mode == "--serve" && (argc == 3 || argc == 4)) {
+            const std::unique_ptr<AgentBackend> backend = AgentBackend::Create(argc > 3 ? argv[3] : "stub");
+            Network net(*backend, argv[2]);
+            if (net.GetUnixPath().empty())
+                return -1;
+            WaitForSignal();
+            return 0;
+        }
+
+        if (argc == 2 || argc == 3) {
+            const char* upstream = argc > 2 ? argv[2] : std::getenv("SSH_AUTH_SOCK");
+            if (!upstream || !*upstream)
+                THROW_RUNTIME_ERROR("SSH_AUTH_SOCK is not set");
+
+            static Relay* active = nullptr;  // for the signal handler
+            Relay relay(argv[1], upstream);
+            active = &relay;
+            std::signal(SIGINT, [](int) { active->Stop(); });
+            std::signal(SIGTERM, [](int) { active->Stop(); });
+            relay.Run();
+            return 0;
+        }
+
+        std::cerr << USAGE << std::endl;
+    } catch (const std::exception& exc) {
+        std::cerr << exc.what() << std::endl;
+    }
+    return -1;
+}
@@ -0,0 +1,261 @@
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "agent_proto.h"
+#include "backend.h"
+#include "capture.h"
+#include "identity_cache.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "common.h"
+
+#ifdef _WIN32
+    #include <Windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#define REPLAY_CONCURRENCY 16  // sessions replayed at once
+
+// Replays a capture made with SSH_PAGEANT_WRAP_CAPTURE against a backend and reports
+// latency and throughput. Every recorded connection is a session whose requests are
+// sent one after another, at the recorded pace divided by the speed (0 means no pauses).
+const char* const USAGE = "usage: ssh-pageant-wrap-replay <capture file> [<backend spec> [<speed>]]";
+
+namespace {
+
+// read-only view of a whole file
+class MappedFile {
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator =(const MappedFile&) = delete;
+
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    const char* GetData() const { return Data; }
+    size_t GetSize() const { return Size; }
+
+private:
+    const char* Data = nullptr;
+    size_t Size = 0;
+#ifdef _WIN32
+    HANDLE File = INVALID_HANDLE_VALUE;
+    HANDLE Mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path)
+{
+    File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (File == INVALID_HANDLE_VALUE)
+        THROW_RUNTIME_ERROR("Couldn't open " << path << ": " << GetLastError());
+
+    LARGE_INTEGER size;
+    Mapping = GetFileSizeEx(File, &size) ? CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL) : nullptr;
+    if (!Mapping) {
+        CloseHandle(File);
+        THROW_RUNTIME_ERROR("Couldn't map " << path << ": " << GetLastError());
+    }
+
+    Size = size_t(size.QuadPart);
+    Data = static_cast<const char*>(MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!Data) {
+        CloseHandle(Mapping);
+        CloseHandle(File);
+        THROW_RUNTIME_ERROR("Couldn't map " << path << ": " << GetLastError());
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    UnmapViewOfFile(Data);
+    CloseHandle(Mapping);
+    CloseHandle(File);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        THROW_RUNTIME_ERROR("Couldn't open " << path << ": " << errno);
+
+    struct stat st;
+    void* data = fstat(fd, &st) == 0 && st.st_size > 0
+            ? mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0)
+            : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+        THROW_RUNTIME_ERROR("Couldn't map " << path << ": " << errno);
+
+    Data = static_cast<const char*>(data);
+    Size = size_t(st.st_size);
+}
+
+MappedFile::~MappedFile()
+{
+    munmap(const_cast<char*>(Data), Size);
+}
+
+#endif
+
+
+struct Request {
+    uint64_t Time;
+    const char* Data;
+    uint32_t Len;
+    uint32_t Stored;
+    uint64_t RecordedNs;  // from the request to its response, zero if there's none
+};
+
+struct Session {
+    std::vector<Request> Requests;
+};
+
+std::vector<Session> Parse(const MappedFile& file) {
+    const char* p = file.GetData();
+    const char* const end = p + file.GetSize();
+    if (file.GetSize() < sizeof(CAPTURE_MAGIC) || std::memcmp(p, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+        THROW_RUNTIME_ERROR("Not a capture file");
+    p += sizeof(CAPTURE_MAGIC);
+
+    std::vector<Session> sessions;
+    std::unordered_map<uint32_t, size_t> byConn;
+    while (size_t(end - p) >= sizeof(CaptureRecord)) {
+        CaptureRecord rec;
+        std::memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if (size_t(end - p) < rec.Stored || rec.Stored > rec.Len)
+            break;  // the capture was cut off
+
+        auto it = byConn.find(rec.Conn);
+        if (rec.Kind == uint8_t(CaptureKind::Request) && rec.Stored >= SA_HEADER_LEN) {
+            if (it == byConn.end()) {
+                it = byConn.emplace(rec.Conn, sessions.size()).first;
+                sessions.emplace_back();
+            }
+            sessions[it->second].Requests.push_back(Request{ rec.Time, p, rec.Len, rec.Stored, 0 });
+        } else if (rec.Kind == uint8_t(CaptureKind::Response) && it != byConn.end()) {
+            Request& req = sessions[it->second].Requests.back();
+            req.RecordedNs = rec.Time - req.Time;
+        }
+        p += rec.Stored;
+    }
+    return sessions;  // ordered by the first request
+}
+
+struct Results {
+    LatencyHistogram Replayed;
+    LatencyHistogram Recorded;
+    std::atomic<uint64_t> Failures;
+
+    Results() : Failures(0) { }
+};
+
+void Replay(const Session& session, Network::Handler& handler, double speed,
+            std::chrono::steady_clock::time_point start, Results& results) {
+    for (const Request& req : session.Requests) {
+        if (speed > 0)
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(uint64_t(req.Time / speed)));
+
+        Network::Handler::Context ctx;
+        try {
+            handler.Begin(ctx);
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Backend failed: " << exc.what());
+            ++results.Failures;
+            continue;
+        }
+
+        try {
+            if (req.Len > ctx.Capacity)
+                THROW_RUNTIME_ERROR("request of " << req.Len << " bytes doesn't fit to the backend");
+
+            // redacted messages keep their type and length, the body is zeroed
+            std::memcpy(ctx.Area, req.Data, req.Stored);
+            std::memset(ctx.Area + req.Stored, 0, req.Len - req.Stored);
+
+            const uint64_t sent = Metrics::Now();
+            handler.Query(ctx, req.Len);
+            results.Replayed.Record(Metrics::Now() - sent);
+            if (req.RecordedNs)
+                results.Recorded.Record(req.RecordedNs);
+        } catch (const std::exception& exc) {
+            LOG_ERROR("Replayed request failed: " << exc.what());
+            ++results.Failures;
+        }
+        handler.End(ctx);
+    }
+}
+
+void Report(const char* name, const LatencyHistogram& h) {
+    std::cout << std::fixed << std::setprecision(1) << name << " latency us: mean " << h.GetMean() / 1000.0
+              << " p50 " << h.GetPercentile(50) / 1000.0 << " p90 " << h.GetPercentile(90) / 1000.0
+              << " p99 " << h.GetPercentile(99) / 1000.0 << " max " << h.GetMax() / 1000.0 << '\n';
+}
+
+}  // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 4) {
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+
+    try {
+        const MappedFile file(argv[1]);
+        const std::vector<Session> sessions = Parse(file);
+        const double speed = argc > 3 ? std::atof(argv[3]) : 1.0;
+
+        // the same chain the wrapper serves clients with
+        const std::unique_ptr<AgentBackend> backend = AgentBackend::Create(argc > 2 ? argv[2] : "stub");
+        Scheduler scheduler(*backend);
+        IdentityCache identities(scheduler);
+
+        Results results;
+        std::atomic<size_t> next(0);
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < REPLAY_CONCURRENCY; ++i) {
+            threads.emplace_back([&] {
+                for (size_t s = next++; s < sessions.size(); s = next++)
+                    Replay(sessions[s], identities, speed, start, results);
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const uint64_t requests = results.Replayed.GetCount();
+        std::cout << sessions.size() << " sessions, " << requests << " requests, " << results.Failures
+                  << " failed in " << std::fixed << std::setprecision(3) << seconds << " s: "
+                  << std::setprecision(1) << (seconds > 0 ? requests / seconds : 0) << " requests/s\n";
+        Report("replayed", results.Replayed);
+        Report("recorded", results.Recorded);
+        return results.Failures ? 1 : 0;
+    } catch (const std::exception& exc) {
+        std::cerr << exc.what() << std::endl;
+    }
+    return -1;
+}
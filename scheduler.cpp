@@ -0,0 +1,117 @@
+#include "scheduler.h"
+#include "agent_proto.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+
+Scheduler::Scheduler(Network::Handler& upstream, size_t concurrency, size_t queueLimit)
+    : Local(upstream, "scheduler")
+    , Concurrency(concurrency ? concurrency : 1)
+    , QueueLimit(queueLimit)
+    , ListingDelay(Config::Get().ListingDelayMs)
+{
+    Queue.reserve(QueueLimit);
+
+    // how long requests queue and how many are refused tells whether the concurrency suits
+    Metrics::AddSource(this, [this](std::ostream& os) {
+        const Stats stats = GetStats();
+        os << "scheduler_concurrency " << Concurrency << " admitted " << stats.Admitted << " rejected "
+           << stats.Rejected << " waits " << stats.Waits << " wait_us " << stats.WaitTimeNs / 1000
+           << " queued " << stats.Depth << " max_queued " << stats.MaxDepth << '\n';
+    });
+}
+
+Scheduler::~Scheduler()
+{
+    Metrics::RemoveSource(this);
+    LOG_DEBUG("Scheduler: " << Counters.Admitted << " admitted, " << Counters.Rejected << " rejected, "
+              << Counters.Waits << " waited for " << Counters.WaitTimeNs / 1000 << " us in total, max queue "
+              << Counters.MaxDepth);
+}
+
+Scheduler::Stats Scheduler::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(Mtx);
+    Stats stats = Counters;
+    stats.Depth = Queue.size();
+    return stats;
+}
+
+Scheduler::Clock::duration Scheduler::Handicap(uint8_t type) const
+{
+    return type == SSH2_AGENTC_REQUEST_IDENTITIES ? Clock::duration(ListingDelay) : Clock::duration::zero();
+}
+
+bool Scheduler::Admit(uint8_t type, uint32_t conn)
+{
+    const auto later = [](const Waiter& a, const Waiter& b) {
+        return a.Deadline != b.Deadline ? a.Deadline > b.Deadline : a.Seq > b.Seq;
+    };
+
+    std::unique_lock<std::mutex> lock(Mtx);
+    if (InFlight < Concurrency && Queue.empty()) {
+        ++InFlight;
+        ++Counters.Admitted;
+        return true;
+    }
+
+    if (Queue.size() >= QueueLimit) {
+        ++Counters.Rejected;
+        return false;
+    }
+
+    const Clock::time_point start = Clock::now();
+    const Waiter me = { start + Handicap(type), NextSeq++ };
+    Queue.push_back(me);
+    std::push_heap(Queue.begin(), Queue.end(), later);
+    Counters.MaxDepth = std::max(Counters.MaxDepth, Queue.size());
+
+    Cv.wait(lock, [this, &me] { return InFlight < Concurrency && Queue.front().Seq == me.Seq; });
+    std::pop_heap(Queue.begin(), Queue.end(), later);
+    Queue.pop_back();
+    ++InFlight;
+
+    const uint64_t waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    ++Counters.Admitted;
+    ++Counters.Waits;
+    Counters.WaitTimeNs += waitNs;
+    TRACE(Scheduled, conn, type, waitNs);
+
+    lock.unlock();
+    Cv.notify_all();  // the next one may fit as well
+    return true;
+}
+
+void Scheduler::Release() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(Mtx);
+        --InFlight;
+    }
+    Cv.notify_all();
+}
+
+Buffer Scheduler::Query(Context& ctx, size_t len)
+{
+    if (!Admit(SaMessageType(ctx.Area, len), ctx.Conn)) {
+        static const char failure[] = { 0, 0, 0, 1, SSH_AGENT_FAILURE };
+        std::memcpy(ctx.Area, failure, sizeof(failure));
+        return Buffer(ctx.Area, sizeof(failure));
+    }
+
+    try {
+        return Local.Forward(ctx, len);
+    } catch (...) {
+        if (!Local.IsForwarded(ctx))
+            Release();  // otherwise End() does it
+        throw;
+    }
+}
+
+void Scheduler::End(Context& ctx) noexcept
+{
+    if (Local.End(ctx))
+        Release();
+}
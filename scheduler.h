@@ -0,0 +1,69 @@
+#pragma once
+#include "common.h"
+#include "config.h"
+#include "forwarder.h"
+#include "network.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+
+// Admits requests to the upstream handler: at most `concurrency` are in flight, the
+// others wait ordered by a deadline, which is the arrival time plus a handicap by
+// message type. So sign requests overtake queued listings, but nothing starves.
+// A connection has at most one request at a time, so arrival order is fair among them.
+// Requests are received into local areas and the upstream handler sees them only once
+// they're admitted, so waiting ones don't hold Pageant channels or agent connections;
+// an admission lasts until End(), when the upstream handler has let go of the request.
+class Scheduler : public Network::Handler {
+public:
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator =(const Scheduler&) = delete;
+
+    struct Stats {
+        uint64_t Admitted = 0;
+        uint64_t Rejected = 0;    // the queue was full
+        uint64_t Waits = 0;       // admissions found no free slot
+        uint64_t WaitTimeNs = 0;  // total time spent in the queue
+        size_t Depth = 0;         // waiting now
+        size_t MaxDepth = 0;
+    };
+
+public:
+    explicit Scheduler(Network::Handler& upstream, size_t concurrency = Config::Get().SchedulerConcurrency,
+                       size_t queueLimit = Config::Get().SchedulerQueueLimit);
+    ~Scheduler();
+
+    void Begin(Context& ctx) override { Local.Begin(ctx); }
+    Buffer Query(Context& ctx, size_t len) override;
+    void End(Context& ctx) noexcept override;
+
+    Stats GetStats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Waiter {
+        Clock::time_point Deadline;
+        uint64_t Seq;  // arrival order among equal deadlines
+    };
+
+    Clock::duration Handicap(uint8_t type) const;
+    bool Admit(uint8_t type, uint32_t conn);  // false if the request is refused
+    void Release() noexcept;
+
+private:
+    Forwarder Local;
+    const size_t Concurrency;
+    const size_t QueueLimit;
+    const std::chrono::milliseconds ListingDelay;
+
+    mutable std::mutex Mtx;
+    std::condition_variable Cv;
+    std::vector<Waiter> Queue;  // heap, the earliest deadline on top
+    size_t InFlight = 0;
+    uint64_t NextSeq = 0;
+    Stats Counters;
+};
@@ -0,0 +1,677 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "agent_proto.h"
+#include "backend.h"
+#include "buffer_pool.h"
+#include "framer.h"
+#include "identity_cache.h"
+#include "metrics.h"
+#include "network.h"
+#include "poller.h"
+#include "scheduler.h"
+#include "common.h"
+
+#ifndef _WIN32
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+#define STRESS_THREADS 8        // hammering the pool at once
+#define STRESS_BLOCKS 4         // held by each thread at a time
+#define STRESS_ROUNDS 20000     // of acquiring and releasing them per thread
+#define STRESS_BLOCK_SIZE 1000  // not a multiple of the cache line on purpose
+#define FRAMER_CAPACITY 256     // small, so messages often take the heap path
+#define FUZZ_ROUNDS 200         // streams fed to the framer in random pieces
+#define FUZZ_MESSAGES 50        // per stream
+#define UPSTREAM_TEST_TIMEOUT_MS 50        // of the upstream agent backend talking to a slow stub
+#define UPSTREAM_TEST_LATENCY_US 500000   // of that stub
+#define POLLER_TEST_TIMEOUT_MS 2000        // of the Wait() interrupted by a signal much earlier
+#define POLLER_TEST_SIGNAL_MS 10           // interval of signals until it's interrupted
+#define SCHEDULER_TEST_WAIT_S 5            // for a request to get queued
+
+// Self-checking tests of components; the upstream agent ones serve the stub agent on
+// a unix socket, so they run on Linux only.
+// Every test throws on the first failed check; the exit code tells whether all passed.
+const char* const USAGE = "usage: ssh-pageant-wrap-test [<name substring>]";
+
+#define CHECK(cond) do { \
+    if (!(cond)) \
+        THROW_RUNTIME_ERROR(__FILE__ << ':' << __LINE__ << ": check failed: " #cond); \
+} while(false)
+
+#define CHECK_EQUAL(a, b) do { \
+    if (!((a) == (b))) \
+        THROW_RUNTIME_ERROR(__FILE__ << ':' << __LINE__ << ": " #a " == " #b " failed: " \
+                            << (a) << " != " << (b)); \
+} while(false)
+
+namespace {
+
+// every thread holds a few blocks at once, scribbles its id over them and checks
+// nobody else got them before giving them back
+void HammerPool(BufferPool& pool, unsigned id, std::atomic<bool>& failed) {
+    char* blocks[STRESS_BLOCKS];
+    for (unsigned round = 0; round < STRESS_ROUNDS && !failed; ++round) {
+        for (char*& block : blocks) {
+            block = pool.Acquire();
+            if (reinterpret_cast<uintptr_t>(block) % CACHE_LINE_SIZE)
+                failed = true;
+            std::memset(block, int(id), pool.GetBlockSize());
+        }
+        for (char* block : blocks) {
+            for (size_t i = 0; i < pool.GetBlockSize(); i += CACHE_LINE_SIZE) {
+                if (block[i] != char(id))
+                    failed = true;
+            }
+            pool.Release(block);
+        }
+    }
+}
+
+void RunHammer(BufferPool& pool) {
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < STRESS_THREADS; ++t)
+        threads.emplace_back(HammerPool, std::ref(pool), t + 1, std::ref(failed));
+    for (std::thread& thread : threads)
+        thread.join();
+    CHECK(!failed);
+}
+
+// with enough blocks preallocated nothing is allocated however hard the pool is hit,
+// and a second wave of the same load leaves the statistics where the first one did;
+// they're exported with the metrics
+void TestBufferPoolStress() {
+    const size_t blocks = STRESS_THREADS * STRESS_BLOCKS;
+    BufferPool pool(STRESS_BLOCK_SIZE, blocks, "stress");
+    CHECK_EQUAL(pool.GetBlockSize() % CACHE_LINE_SIZE, 0u);
+    CHECK(pool.GetBlockSize() >= STRESS_BLOCK_SIZE);
+
+    RunHammer(pool);
+    const BufferPool::Stats first = pool.GetStats();
+    CHECK_EQUAL(first.Misses, 0u);
+    CHECK_EQUAL(first.Blocks, blocks);
+    CHECK_EQUAL(first.InUse, 0u);
+    CHECK_EQUAL(first.Acquired, size_t(STRESS_THREADS) * STRESS_BLOCKS * STRESS_ROUNDS);
+    CHECK(first.HighWater <= blocks);
+
+    RunHammer(pool);
+    const BufferPool::Stats second = pool.GetStats();
+    CHECK_EQUAL(second.Misses, 0u);
+    CHECK_EQUAL(second.Blocks, blocks);
+    CHECK_EQUAL(second.InUse, 0u);
+    CHECK_EQUAL(second.Acquired, 2 * first.Acquired);
+    CHECK(second.HighWater <= blocks);
+
+    std::ostringstream metrics;
+    Metrics::Dump(metrics);
+    CHECK(metrics.str().find("buffer_pool stress block_size ") != std::string::npos);
+    CHECK(metrics.str().find(" misses 0\n") != std::string::npos);
+}
+
+// a pool started too small grows on misses only until it covers the load
+void TestBufferPoolGrowth() {
+    BufferPool pool(STRESS_BLOCK_SIZE, 1);
+    RunHammer(pool);
+    const BufferPool::Stats first = pool.GetStats();
+    CHECK(first.Misses > 0);
+    CHECK_EQUAL(first.InUse, 0u);
+    CHECK_EQUAL(first.Blocks, 1 + first.Misses);
+    CHECK(first.HighWater <= size_t(STRESS_THREADS) * STRESS_BLOCKS);
+    CHECK(first.HighWater <= first.Blocks);
+
+    // the load now fits as long as it doesn't peak higher than before
+    for (unsigned i = 0; i < 100; ++i) {
+        std::vector<char*> held;
+        for (size_t n = 0; n < first.HighWater; ++n)
+            held.push_back(pool.Acquire());
+        for (char* block : held)
+            pool.Release(block);
+    }
+    const BufferPool::Stats second = pool.GetStats();
+    CHECK_EQUAL(second.Misses, first.Misses);
+    CHECK_EQUAL(second.Blocks, first.Blocks);
+    CHECK_EQUAL(second.HighWater, first.HighWater);
+}
+
+
+// ssh-agent message with the header, the body filled with `fill`
+std::vector<char> MakeMessage(size_t bodyLen, char fill) {
+    std::vector<char> msg(SA_HEADER_LEN + bodyLen, fill);
+    const uint32_t len = htonl(uint32_t(bodyLen));
+    std::memcpy(msg.data(), &len, sizeof(len));
+    return msg;
+}
+
+void Feed(Framer& frames, const char* data, size_t len) {
+    CHECK(len <= frames.GetSpaceLen());
+    std::memcpy(frames.GetSpace(), data, len);
+    frames.Received(len);
+}
+
+// takes the complete message at the head of the input, if any
+bool TakeMessage(Framer& frames, std::vector<char>& msg) {
+    const size_t len = frames.PeekMessage();
+    if (!len)
+        return false;
+    msg.assign(frames.GetInput(), frames.GetInput() + len);
+    frames.Consume(len);
+    return true;
+}
+
+// a header coming in pieces isn't taken for a message, neither is a header without its body
+void TestFramerSplitHeader() {
+    std::vector<char> in(FRAMER_CAPACITY), out(FRAMER_CAPACITY);
+    Framer frames;
+    frames.Attach(in.data(), out.data(), in.size());
+
+    const std::vector<char> msg = MakeMessage(10, 'a');
+    Feed(frames, msg.data(), 2);
+    CHECK_EQUAL(frames.PeekMessage(), 0u);
+    Feed(frames, msg.data() + 2, 2);
+    CHECK_EQUAL(frames.PeekMessage(), 0u);
+    Feed(frames, msg.data() + 4, msg.size() - 5);
+    CHECK_EQUAL(frames.PeekMessage(), 0u);
+    Feed(frames, msg.data() + msg.size() - 1, 1);
+    CHECK_EQUAL(frames.PeekMessage(), msg.size());
+
+    frames.Consume(msg.size());
+    CHECK_EQUAL(frames.GetInputLen(), 0u);
+    CHECK_EQUAL(frames.GetSpaceLen(), size_t(FRAMER_CAPACITY));
+
+    // a message of just the header is complete as well
+    const std::vector<char> empty = MakeMessage(0, 0);
+    Feed(frames, empty.data(), empty.size());
+    CHECK_EQUAL(frames.PeekMessage(), size_t(SA_HEADER_LEN));
+}
+
+// messages fed a byte at a time come out whole and in order, big ones included
+void TestFramerByteFeed() {
+    std::vector<char> in(FRAMER_CAPACITY), out(FRAMER_CAPACITY);
+    Framer frames;
+    frames.Attach(in.data(), out.data(), in.size());
+
+    std::vector<std::vector<char>> sent;
+    std::vector<char> stream;
+    const size_t lengths[] = { 1, 0, FRAMER_CAPACITY - SA_HEADER_LEN, FRAMER_CAPACITY - SA_HEADER_LEN + 1,
+                               3 * FRAMER_CAPACITY, 5 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        sent.push_back(MakeMessage(lengths[i], char('a' + i)));
+        stream.insert(stream.end(), sent.back().begin(), sent.back().end());
+    }
+
+    std::vector<std::vector<char>> framed;
+    std::vector<char> msg;
+    for (char c : stream) {
+        Feed(frames, &c, 1);
+        while (TakeMessage(frames, msg))
+            framed.push_back(msg);
+    }
+    CHECK(framed == sent);
+    CHECK_EQUAL(frames.GetInputLen(), 0u);
+    CHECK(frames.GetSpace() == in.data());  // back from the heap
+}
+
+// lengths up to SA_MAX_MESSAGE_LEN with the header move the input to the heap, longer ones throw
+void TestFramerOversize() {
+    std::vector<char> in(FRAMER_CAPACITY), out(FRAMER_CAPACITY);
+    Framer frames;
+    frames.Attach(in.data(), out.data(), in.size());
+
+    const std::vector<char> big = MakeMessage(SA_MAX_MESSAGE_LEN - SA_HEADER_LEN, 'b');
+    Feed(frames, big.data(), SA_HEADER_LEN);
+    CHECK_EQUAL(frames.PeekMessage(), 0u);
+    CHECK_EQUAL(frames.GetSpaceLen(), size_t(SA_MAX_MESSAGE_LEN - SA_HEADER_LEN));
+    Feed(frames, big.data() + SA_HEADER_LEN, big.size() - SA_HEADER_LEN);
+    CHECK_EQUAL(frames.PeekMessage(), size_t(SA_MAX_MESSAGE_LEN));
+    CHECK(std::memcmp(frames.GetInput(), big.data(), big.size()) == 0);
+    frames.Consume(big.size());
+    CHECK(frames.GetSpace() == in.data());
+    CHECK_EQUAL(frames.GetSpaceLen(), size_t(FRAMER_CAPACITY));
+
+    const std::vector<char> tooBig = MakeMessage(SA_MAX_MESSAGE_LEN - SA_HEADER_LEN + 1, 0);
+    Feed(frames, tooBig.data(), SA_HEADER_LEN);
+    bool thrown = false;
+    try {
+        frames.PeekMessage();
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+// output beyond the caller's buffer goes to the heap and comes back once it's sent
+void TestFramerOutput() {
+    std::vector<char> in(FRAMER_CAPACITY), out(FRAMER_CAPACITY);
+    Framer frames;
+    frames.Attach(in.data(), out.data(), out.size());
+
+    const std::vector<char> first = MakeMessage(FRAMER_CAPACITY / 2, 'x');
+    const std::vector<char> second = MakeMessage(FRAMER_CAPACITY, 'y');
+    frames.Queue(first.data(), first.size());
+    CHECK(frames.GetUnsent().ptr == out.data());
+    frames.Sent(10);
+    frames.Queue(second.data(), second.size());
+    CHECK(frames.GetUnsent().ptr != out.data());
+
+    std::vector<char> expected(first.begin() + 10, first.end());
+    expected.insert(expected.end(), second.begin(), second.end());
+    const Buffer unsent = frames.GetUnsent();
+    CHECK_EQUAL(unsent.len, expected.size());
+    CHECK(std::memcmp(unsent.ptr, expected.data(), expected.size()) == 0);
+
+    frames.Sent(unsent.len - 1);
+    CHECK(frames.HasOutput());
+    frames.Sent(1);
+    CHECK(!frames.HasOutput());
+    CHECK_EQUAL(frames.GetOutputLen(), 0u);
+
+    frames.Queue(first.data(), first.size());
+    CHECK(frames.GetUnsent().ptr == out.data());
+}
+
+// random streams in random pieces frame to exactly what was sent
+void TestFramerFuzz() {
+    std::minstd_rand rng(12345);
+    std::vector<char> in(FRAMER_CAPACITY), out(FRAMER_CAPACITY);
+    Framer frames;
+
+    for (unsigned round = 0; round < FUZZ_ROUNDS; ++round) {
+        frames.Attach(in.data(), out.data(), in.size());
+        std::vector<std::vector<char>> sent;
+        std::vector<char> stream;
+        for (unsigned i = 0; i < FUZZ_MESSAGES; ++i) {
+            const size_t len = rng() % 4 ? rng() % FRAMER_CAPACITY : rng() % (4 * FRAMER_CAPACITY);
+            sent.push_back(MakeMessage(len, char(rng())));
+            stream.insert(stream.end(), sent.back().begin(), sent.back().end());
+        }
+
+        std::vector<std::vector<char>> framed;
+        std::vector<char> msg;
+        for (size_t pos = 0; pos < stream.size(); ) {
+            while (TakeMessage(frames, msg))
+                framed.push_back(msg);
+            const size_t piece = std::min<size_t>({ 1 + rng() % (2 * FRAMER_CAPACITY), frames.GetSpaceLen(),
+                                                    stream.size() - pos });
+            Feed(frames, stream.data() + pos, piece);
+            pos += piece;
+        }
+        while (TakeMessage(frames, msg))
+            framed.push_back(msg);
+
+        CHECK(framed == sent);
+        CHECK_EQUAL(frames.GetInputLen(), 0u);
+    }
+}
+
+
+// sends the request through the handler like a network worker, returns the response
+std::vector<char> Ask(Network::Handler& agent, const std::vector<char>& req, uint32_t conn = 0) {
+    Network::Handler::Context ctx;
+    ctx.Conn = conn;
+    agent.Begin(ctx);
+    try {
+        CHECK(req.size() <= ctx.Capacity);
+        std::memcpy(ctx.Area, req.data(), req.size());
+        const Buffer resp = agent.Query(ctx, req.size());
+        const char* p = static_cast<const char*>(resp.ptr);
+        std::vector<char> out(p, p + resp.len);
+        agent.End(ctx);
+        return out;
+    } catch (...) {
+        agent.End(ctx);
+        throw;
+    }
+}
+
+
+// holds every query until opened and counts the requests checked out of it,
+// like Pageant's channels; lists no identities and accepts everything else
+class GateHandler : public Network::Handler {
+public:
+    void Begin(Context& ctx) override {
+        std::lock_guard<std::mutex> lock(Mtx);
+        ctx.Area = Areas[ctx.Conn % 2];
+        ctx.Capacity = sizeof(Areas[0]);
+        ++CheckedOut;
+    }
+    Buffer Query(Context& ctx, size_t len) override {
+        std::unique_lock<std::mutex> lock(Mtx);
+        ++Querying;
+        Cv.notify_all();
+        Cv.wait(lock, [this] { return Opened; });
+        static const char identities[] = { 0, 0, 0, 5, SSH2_AGENT_IDENTITIES_ANSWER, 0, 0, 0, 0 };
+        static const char success[] = { 0, 0, 0, 1, SSH_AGENT_SUCCESS };
+        if (SaMessageType(ctx.Area, len) == SSH2_AGENTC_REQUEST_IDENTITIES) {
+            std::memcpy(ctx.Area, identities, sizeof(identities));
+            return Buffer(ctx.Area, sizeof(identities));
+        }
+        std::memcpy(ctx.Area, success, sizeof(success));
+        return Buffer(ctx.Area, sizeof(success));
+    }
+    void End(Context&) noexcept override {
+        std::lock_guard<std::mutex> lock(Mtx);
+        --CheckedOut;
+    }
+
+    void WaitQuerying(unsigned count) {
+        std::unique_lock<std::mutex> lock(Mtx);
+        Cv.wait(lock, [this, count] { return Querying >= count; });
+    }
+    unsigned GetCheckedOut() {
+        std::lock_guard<std::mutex> lock(Mtx);
+        return CheckedOut;
+    }
+    void Open() {
+        std::lock_guard<std::mutex> lock(Mtx);
+        Opened = true;
+        Cv.notify_all();
+    }
+
+private:
+    std::mutex Mtx;
+    std::condition_variable Cv;
+    char Areas[2][SA_HEADER_LEN + 16];
+    unsigned CheckedOut = 0;
+    unsigned Querying = 0;
+    bool Opened = false;
+};
+
+// a request waiting for admission doesn't hold an upstream area
+void TestSchedulerCheckout() {
+    GateHandler gate;
+    Scheduler scheduler(gate, 1, 4);
+
+    std::vector<char> first, second;
+    std::thread signer([&] { first = Ask(scheduler, MakeMessage(1, SSH2_AGENTC_SIGN_REQUEST), 0); });
+    gate.WaitQuerying(1);
+    std::thread lister([&] { second = Ask(scheduler, MakeMessage(1, SSH2_AGENTC_REQUEST_IDENTITIES), 1); });
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(SCHEDULER_TEST_WAIT_S);
+    while (scheduler.GetStats().MaxDepth == 0 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+    CHECK_EQUAL(scheduler.GetStats().MaxDepth, 1u);
+    CHECK_EQUAL(gate.GetCheckedOut(), 1u);
+
+    gate.Open();
+    signer.join();
+    lister.join();
+    CHECK_EQUAL(int(first[SA_HEADER_LEN]), SSH_AGENT_SUCCESS);
+    CHECK_EQUAL(int(second[SA_HEADER_LEN]), SSH2_AGENT_IDENTITIES_ANSWER);
+    CHECK_EQUAL(gate.GetCheckedOut(), 0u);
+
+    const Scheduler::Stats stats = scheduler.GetStats();
+    CHECK_EQUAL(stats.Admitted, 2u);
+    CHECK_EQUAL(stats.Waits, 1u);
+
+    std::ostringstream metrics;
+    Metrics::Dump(metrics);
+    CHECK(metrics.str().find("scheduler_concurrency 1 admitted 2 rejected 0 waits 1 ") != std::string::npos);
+}
+
+// identities answered from memory don't check out an upstream area
+void TestIdentityCacheHit() {
+    GateHandler gate;
+    gate.Open();
+    IdentityCache cache(gate, std::chrono::minutes(1));
+    const std::vector<char> listing = MakeMessage(1, SSH2_AGENTC_REQUEST_IDENTITIES);
+    const std::vector<char> answer = Ask(cache, listing);
+    CHECK_EQUAL(int(answer[SA_HEADER_LEN]), SSH2_AGENT_IDENTITIES_ANSWER);
+
+    Network::Handler::Context ctx;
+    cache.Begin(ctx);
+    std::memcpy(ctx.Area, listing.data(), listing.size());
+    const Buffer resp = cache.Query(ctx, listing.size());
+    const char* p = static_cast<const char*>(resp.ptr);
+    const bool same = std::vector<char>(p, p + resp.len) == answer;
+    const unsigned checkedOut = gate.GetCheckedOut();
+    cache.End(ctx);
+    CHECK(same);
+    CHECK_EQUAL(checkedOut, 0u);
+
+    const IdentityCache::Stats stats = cache.GetStats();
+    CHECK_EQUAL(stats.Misses, 1u);
+    CHECK_EQUAL(stats.Hits, 1u);
+
+    std::ostringstream metrics;
+    Metrics::Dump(metrics);
+    CHECK(metrics.str().find("identity_cache hits 1 misses 1 coalesced 0 ") != std::string::npos);
+}
+
+// a stub's latency is a plain number of microseconds, anything else is refused
+void TestBackendStubSpec() {
+    CHECK_EQUAL(std::string(AgentBackend::Create("stub")->GetName()), "stub");
+    CHECK_EQUAL(std::string(AgentBackend::Create("stub:250")->GetName()), "stub");
+
+    for (const char* spec : { "stub:abc", "stub:12x", "stub:-1", "stub: 5", "stub:+5", "stub:60000001",
+                              "stub:99999999999999999999" }) {
+        bool thrown = false;
+        try {
+            AgentBackend::Create(spec);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        if (!thrown)
+            THROW_RUNTIME_ERROR("stub spec accepted: " << spec);
+    }
+}
+
+#ifndef _WIN32
+void OnTestSignal(int) { }
+
+// a Wait() interrupted by a signal reports no events, not the previous batch again
+void TestPollerInterrupted() {
+    struct sigaction action = {};
+    action.sa_handler = OnTestSignal;  // without SA_RESTART, so EINTR is seen
+    struct sigaction previous;
+    CHECK(sigaction(SIGUSR1, &action, &previous) == 0);
+
+    int socks[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+    Poller poll;
+    int tag = 0;
+    poll.Add(socks[0], Poller::In, &tag);
+    CHECK(send(socks[1], "x", 1, 0) == 1);
+
+    std::vector<Poller::Event> events;
+    CHECK_EQUAL(poll.Wait(events, POLLER_TEST_TIMEOUT_MS), 1u);
+    CHECK(events[0].Data == &tag);
+
+    // the socket is disarmed now, so only the signal ends the next wait early
+    std::atomic<bool> waited(false);
+    const pthread_t waiter = pthread_self();
+    std::thread signaller([&waited, waiter] {
+        while (!waited) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLLER_TEST_SIGNAL_MS));
+            pthread_kill(waiter, SIGUSR1);
+        }
+    });
+    const auto start = std::chrono::steady_clock::now();
+    const size_t count = poll.Wait(events, POLLER_TEST_TIMEOUT_MS);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    waited = true;
+    signaller.join();
+
+    poll.Remove(socks[0]);
+    close(socks[0]);
+    close(socks[1]);
+    sigaction(SIGUSR1, &previous, nullptr);
+
+    CHECK_EQUAL(count, 0u);
+    CHECK(events.empty());
+    CHECK(elapsed < std::chrono::milliseconds(POLLER_TEST_TIMEOUT_MS));
+}
+
+std::string StubAgentPath(const char* name) {
+    return "/tmp/ssh-pageant-wrap-test." + std::to_string(getpid()) + "." + name;
+}
+
+// answers come through the pool, a connection closed by the restarted agent is
+// reopened, and the pool's counters are exported with the metrics
+void TestUpstreamReconnect() {
+    const std::string path = StubAgentPath("agent");
+    StubBackend stub(0);
+    std::unique_ptr<Network> net(new Network(stub, path));
+    CHECK(!net->GetUnixPath().empty());
+
+    UpstreamAgentBackend upstream(path, 2);
+    const std::vector<char> listing = Ask(upstream, MakeMessage(1, SSH2_AGENTC_REQUEST_IDENTITIES));
+    CHECK_EQUAL(listing.size(), SA_HEADER_LEN + 5u);
+    CHECK_EQUAL(int(listing[SA_HEADER_LEN]), SSH2_AGENT_IDENTITIES_ANSWER);
+    const std::vector<char> signature = Ask(upstream, MakeMessage(16, SSH2_AGENTC_SIGN_REQUEST));
+    CHECK_EQUAL(signature.size(), SA_HEADER_LEN + 5u + STUB_SIGNATURE_LEN);
+    CHECK_EQUAL(int(signature[SA_HEADER_LEN]), SSH2_AGENT_SIGN_RESPONSE);
+
+    net.reset();
+    net.reset(new Network(stub, path));
+    CHECK(Ask(upstream, MakeMessage(16, SSH2_AGENTC_SIGN_REQUEST)) == signature);
+
+    const UpstreamAgentBackend::PoolStats stats = upstream.GetStats();
+    CHECK_EQUAL(stats.Acquisitions, 3u);
+    CHECK_EQUAL(stats.Connects, 2u);
+    CHECK_EQUAL(stats.Dropped, 1u);
+    CHECK_EQUAL(stats.Waits, 0u);
+
+    std::ostringstream metrics;
+    Metrics::Dump(metrics);
+    CHECK(metrics.str().find("upstream_connections 2 acquisitions 3 ") != std::string::npos);
+}
+
+// a Cygwin client connected to the wrapper's TCP port, the handshake isn't done yet
+int ConnectLoopback(uint16_t port) {
+    const int sock = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(sock != INVALID_SOCKET);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    CHECK(connect(sock, (const sockaddr*)&addr, sizeof(addr)) == 0);
+    return sock;
+}
+
+// sends the data and returns as much as comes back, less if the connection is closed
+std::vector<char> Exchange(int sock, const char* data, size_t len, size_t respLen) {
+    CHECK(send(sock, data, len, MSG_NOSIGNAL) == ssize_t(len));
+    std::vector<char> resp(respLen);
+    size_t got = 0;
+    while (got < respLen) {
+        const ssize_t rc = recv(sock, resp.data() + got, respLen - got, 0);
+        if (rc <= 0)
+            break;
+        got += size_t(rc);
+    }
+    resp.resize(got);
+    return resp;
+}
+
+// only clients knowing the secret from the socket file get past the handshake
+void TestNetworkSecret() {
+    StubBackend stub(0);
+    Network net(stub);
+
+    char wrong[CYGWIN_SECRET_LEN];
+    std::memcpy(wrong, net.GetSecret(), sizeof(wrong));
+    wrong[CYGWIN_SECRET_LEN - 1] ^= 1;
+    int sock = ConnectLoopback(net.GetPort());
+    CHECK(Exchange(sock, wrong, sizeof(wrong), sizeof(wrong)).empty());
+    close(sock);
+
+    sock = ConnectLoopback(net.GetPort());
+    const std::vector<char> secret(net.GetSecret(), net.GetSecret() + CYGWIN_SECRET_LEN);
+    CHECK(Exchange(sock, secret.data(), secret.size(), secret.size()) == secret);
+    const std::vector<char> cred(CYGWIN_CRED_LEN, 1);
+    CHECK(Exchange(sock, cred.data(), cred.size(), cred.size()) == cred);
+    const std::vector<char> listing = MakeMessage(1, SSH2_AGENTC_REQUEST_IDENTITIES);
+    const std::vector<char> answer = Exchange(sock, listing.data(), listing.size(), SA_HEADER_LEN + 5);
+    CHECK_EQUAL(answer.size(), SA_HEADER_LEN + 5u);
+    CHECK_EQUAL(int(answer[SA_HEADER_LEN]), SSH2_AGENT_IDENTITIES_ANSWER);
+    close(sock);
+
+    Network other(stub);
+    CHECK(std::memcmp(net.GetSecret(), other.GetSecret(), CYGWIN_SECRET_LEN) != 0);
+}
+
+// a hung agent fails the request in time instead of holding the connection
+void TestUpstreamTimeout() {
+    const std::string path = StubAgentPath("slow");
+    StubBackend slow(UPSTREAM_TEST_LATENCY_US);
+    Network net(slow, path);
+    CHECK(!net.GetUnixPath().empty());
+
+    UpstreamAgentBackend upstream(path, 1, UPSTREAM_IDLE_TIMEOUT_MS, UPSTREAM_TEST_TIMEOUT_MS);
+    const auto start = std::chrono::steady_clock::now();
+    bool failed = false;
+    try {
+        Ask(upstream, MakeMessage(1, SSH2_AGENTC_REQUEST_IDENTITIES));
+    } catch (const std::exception&) {
+        failed = true;
+    }
+    CHECK(failed);
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::microseconds(UPSTREAM_TEST_LATENCY_US));
+    CHECK_EQUAL(upstream.GetStats().Dropped, 1u);
+
+    CHECK(net.Shutdown(2 * UPSTREAM_TEST_LATENCY_US / 1000));  // the stub is still answering
+}
+#endif
+
+}  // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+    if (argc > 2) {
+        std::cerr << USAGE << std::endl;
+        return -1;
+    }
+    const std::string filter = argc > 1 ? argv[1] : "";
+
+    const std::pair<const char*, void (*)()> tests[] = {
+        { "buffer_pool/stress", TestBufferPoolStress },
+        { "buffer_pool/growth", TestBufferPoolGrowth },
+        { "framer/split_header", TestFramerSplitHeader },
+        { "framer/byte_feed", TestFramerByteFeed },
+        { "framer/oversize", TestFramerOversize },
+        { "framer/output", TestFramerOutput },
+        { "framer/fuzz", TestFramerFuzz },
+        { "scheduler/checkout", TestSchedulerCheckout },
+        { "identity_cache/hit", TestIdentityCacheHit },
+        { "backend/stub_spec", TestBackendStubSpec },
+#ifndef _WIN32
+        { "poller/interrupted", TestPollerInterrupted },
+        { "network/secret", TestNetworkSecret },
+        { "upstream/reconnect", TestUpstreamReconnect },
+        { "upstream/timeout", TestUpstreamTimeout },
+#endif
+    };
+
+    unsigned failures = 0;
+    for (const auto& test : tests) {
+        if (std::string(test.first).find(filter) == std::string::npos)
+            continue;
+        try {
+            test.second();
+            std::cout << "ok   " << test.first << std::endl;
+        } catch (const std::exception& exc) {
+            std::cout << "FAIL " << test.first << ": " << exc.what() << std::endl;
+            ++failures;
+        }
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+#include "trace.h"
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define TRACE_RING_SIZE 4096  // records per thread, power of two
+
+namespace {
+
+const char* const EventNames[] = {
+    "accepted",
+    "closed",
+    "handshake",
+    "request",
+    "response",
+    "batched",
+    "flushed",
+    "channel-wait",
+    "pageant-query",
+    "pageant-found",
+    "pageant-retry",
+    "pageant-timeout",
+    "pageant-refused",
+    "upstream-query",
+    "cache-hit",
+    "cache-miss",
+    "cache-invalidated",
+    "scheduled",
+};
+static_assert(sizeof(EventNames) / sizeof(EventNames[0]) == size_t(TraceEvent::Count_),
+              "every trace event must have a name");
+
+struct TraceRecord {
+    uint64_t Time;  // nanoseconds since tracing started
+    uint16_t Event;
+    uint16_t Thread;
+    uint32_t Conn;
+    uint64_t Arg[2];
+};
+
+// single producer (the owning thread), single consumer (the flusher)
+struct Ring {
+    std::atomic<uint64_t> Head;
+    char Pad[CACHE_LINE_SIZE];  // producer and consumer don't share cache lines
+    std::atomic<uint64_t> Tail;
+    std::atomic<uint64_t> Dropped;
+    uint16_t Thread;
+    TraceRecord Records[TRACE_RING_SIZE];
+
+    explicit Ring(uint16_t thread) : Head(0), Tail(0), Dropped(0), Thread(thread) { }
+};
+
+using Clock = std::chrono::steady_clock;
+
+Clock::time_point StartTime;
+std::FILE* Output = nullptr;
+
+std::mutex RingsMtx;
+std::vector<std::unique_ptr<Ring>> Rings;  // guarded by RingsMtx, never shrinks while tracing
+
+std::mutex FlushMtx;  // there is only one consumer at a time
+std::mutex FlusherMtx;
+std::condition_variable FlusherCv;
+bool FlusherStop = false;
+std::thread Flusher;
+
+thread_local Ring* ThreadRing = nullptr;
+
+Ring* RegisterThread() {
+    std::lock_guard<std::mutex> lock(RingsMtx);
+    Rings.emplace_back(new Ring(uint16_t(Rings.size())));
+    return Rings.back().get();
+}
+
+void Drain(Ring& ring) {
+    const uint64_t tail = ring.Tail.load(std::memory_order_relaxed);
+    const uint64_t head = ring.Head.load(std::memory_order_acquire);
+
+    for (uint64_t i = tail; i != head; ++i) {
+        const TraceRecord& rec = ring.Records[i & (TRACE_RING_SIZE - 1)];
+        const char* name = rec.Event < size_t(TraceEvent::Count_) ? EventNames[rec.Event] : "?";
+        std::fprintf(Output, "%llu.%06llu t%u c%u %s %llu %llu\n",
+                     (unsigned long long)(rec.Time / 1000000000), (unsigned long long)(rec.Time % 1000000000 / 1000),
+                     unsigned(rec.Thread), unsigned(rec.Conn), name,
+                     (unsigned long long)rec.Arg[0], (unsigned long long)rec.Arg[1]);
+    }
+    ring.Tail.store(head, std::memory_order_release);
+
+    if (const uint64_t dropped = ring.Dropped.exchange(0, std::memory_order_relaxed))
+        std::fprintf(Output, "t%u dropped %llu records\n", unsigned(ring.Thread), (unsigned long long)dropped);
+}
+
+void RunFlusher(unsigned intervalMs) {
+    std::unique_lock<std::mutex> lock(FlusherMtx);
+    while (!FlusherCv.wait_for(lock, std::chrono::milliseconds(intervalMs), [] { return FlusherStop; }))
+        Trace::Flush();
+}
+
+}  // anonymous namespace
+
+
+std::atomic<bool> Trace::Enabled(false);
+
+void Trace::Start(const std::string& path, unsigned flushIntervalMs)
+{
+    if (IsEnabled())
+        return;
+
+    Output = std::fopen(path.c_str(), "a");
+    if (!Output)
+        THROW_RUNTIME_ERROR("couldn't open trace file " << path);
+
+    StartTime = Clock::now();
+    FlusherStop = false;
+    Flusher = std::thread(&RunFlusher, flushIntervalMs);
+    Enabled.store(true, std::memory_order_release);
+    LOG_DEBUG("Tracing to " << path);
+}
+
+void Trace::Stop()
+{
+    if (!IsEnabled())
+        return;
+
+    Enabled.store(false, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(FlusherMtx);
+        FlusherStop = true;
+    }
+    FlusherCv.notify_all();
+    try { Flusher.join(); } catch (...) { }
+
+    Flush();
+    std::fclose(Output);
+    Output = nullptr;
+}
+
+void Trace::Flush()
+{
+    std::lock_guard<std::mutex> flushLock(FlushMtx);
+    if (!Output)
+        return;
+
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(RingsMtx);
+        for (const std::unique_ptr<Ring>& ring : Rings)
+            rings.push_back(ring.get());
+    }
+
+    for (Ring* ring : rings)
+        Drain(*ring);
+    std::fflush(Output);
+}
+
+void Trace::Record(TraceEvent event, uint32_t conn, uint64_t arg0, uint64_t arg1) noexcept
+{
+    Ring* ring = ThreadRing;
+    if (!ring) {
+        try {
+            ring = ThreadRing = RegisterThread();
+        } catch (...) {
+            return;
+        }
+    }
+
+    const uint64_t head = ring->Head.load(std::memory_order_relaxed);
+    if (head - ring->Tail.load(std::memory_order_acquire) == TRACE_RING_SIZE) {
+        ring->Dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceRecord& rec = ring->Records[head & (TRACE_RING_SIZE - 1)];
+    rec.Time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - StartTime).count();
+    rec.Event = uint16_t(event);
+    rec.Thread = ring->Thread;
+    rec.Conn = conn;
+    rec.Arg[0] = arg0;
+    rec.Arg[1] = arg1;
+    ring->Head.store(head + 1, std::memory_order_release);
+}
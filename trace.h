@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+enum class TraceEvent : uint16_t {
+    Accepted,          // arg0: listener's initial stage
+    Closed,
+    Handshake,         // arg0: stage passed
+    Request,           // arg0: message type, arg1: length
+    Response,          // arg0: message type, arg1: length
+    Batched,           // response queued behind pipelined ones; arg0: bytes queued
+    Flushed,           // arg0: bytes sent from the output buffer
+    ChannelWait,       // arg0: nanoseconds
+    PageantQuery,      // arg0: request length, arg1: response length
+    PageantFound,      // window (re)discovered in the background
+    PageantRetry,      // arg0: attempt, arg1: backoff in ms
+    PageantTimeout,    // arg0: request length, arg1: timeout in ms
+    PageantRefused,    // arg0: request length
+    UpstreamQuery,     // arg0: request length, arg1: response length
+    CacheHit,
+    CacheMiss,
+    CacheInvalidated,  // arg0: message type
+    Scheduled,         // admitted after waiting; arg0: message type, arg1: nanoseconds
+
+    Count_
+};
+
+
+// Low overhead tracing: every thread appends fixed-size binary records to its own
+// lock-free ring buffer, a background thread drains the rings and formats records
+// to a file. When tracing isn't started, TRACE() costs a relaxed load and a branch.
+class Trace {
+public:
+    static void Start(const std::string& path, unsigned flushIntervalMs = 200);
+    static void Stop();   // flushes everything recorded so far
+    static void Flush();
+
+    static bool IsEnabled() { return Enabled.load(std::memory_order_relaxed); }
+    static void Record(TraceEvent event, uint32_t conn, uint64_t arg0, uint64_t arg1) noexcept;
+
+private:
+    static std::atomic<bool> Enabled;
+};
+
+#define TRACE(event, conn, arg0, arg1) do { \
+    if (Trace::IsEnabled()) \
+        Trace::Record(TraceEvent::event, (conn), (arg0), (arg1)); \
+} while(false)